@@ -0,0 +1,259 @@
+#include "shell.h"
+
+#include <math.h>
+#include <spawn.h>
+#include <sys/resource.h>
+
+/* Longest time (in ns) from fork until `execve` among processes started
+ * while 'bench' runs. It's shared with them, as only they can measure it. */
+long *launchtime = NULL;
+
+static struct timespec forked; /* in a child, when it has been forked */
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/* Called by a child right after fork. */
+void stampfork(void) {
+  if (launchtime)
+    clock_gettime(CLOCK_MONOTONIC, &forked);
+}
+
+/* Called by a child just before `execve`. Processes of a pipeline race to
+ * leave their launch time, hence atomic update. */
+void stampexec(void) {
+  struct timespec now;
+
+  if (launchtime == NULL || forked.tv_sec == 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ns = (now.tv_sec - forked.tv_sec) * 1000000000L +
+            (now.tv_nsec - forked.tv_nsec);
+  long old = __atomic_load_n(launchtime, __ATOMIC_RELAXED);
+  while (ns > old && !__atomic_compare_exchange_n(launchtime, &old, ns, false,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED))
+    continue;
+}
+
+static double tvms(const struct timeval *tv) {
+  return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+static int doublecmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Value below which fraction `p` of sorted samples lie (nearest rank). */
+static double percentile(double *v, int n, double p) {
+  int k = ceil(p * n) - 1;
+  return v[max(min(k, n - 1), 0)];
+}
+
+/* Format milliseconds with a unit that keeps a few significant digits. */
+static char *fmtms(double ms, char *buf, size_t size) {
+  if (ms < 1)
+    snprintf(buf, size, "%.1fus", ms * 1e3);
+  else if (ms < 1000)
+    snprintf(buf, size, "%.2fms", ms);
+  else
+    snprintf(buf, size, "%.2fs", ms / 1e3);
+  return buf;
+}
+
+typedef struct {
+  double *wall;     /* wall time of each run */
+  double *launch;   /* longest time from fork until execve in each run */
+  int nlaunch;      /* runs that have launched an external command */
+  double *spawn;    /* wall time of each run started with posix_spawn */
+  int nspawn;
+  struct rusage ru; /* summed over all runs */
+} results_t;
+
+/* Evaluate the command line once. Returns false if the run has been killed
+ * or stopped by a signal, so benchmark should stop. */
+static bool run(const char *cmdline, results_t *r, int i) {
+  struct timespec start, end;
+  struct rusage before, after;
+  char *line = strdup(cmdline); /* tokenizer destroys the command line */
+
+  *launchtime = 0;
+  fgsignal = 0;
+  getrusage(RUSAGE_CHILDREN, &before);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  eval(line);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_CHILDREN, &after);
+  free(line);
+
+  if (fgsignal)
+    return false;
+  if (r == NULL)
+    return true;
+
+  r->wall[i] = elapsed(&start, &end);
+  if (*launchtime)
+    r->launch[r->nlaunch++] = *launchtime / 1e6;
+
+  r->ru.ru_utime.tv_sec += after.ru_utime.tv_sec - before.ru_utime.tv_sec;
+  r->ru.ru_utime.tv_usec += after.ru_utime.tv_usec - before.ru_utime.tv_usec;
+  r->ru.ru_stime.tv_sec += after.ru_stime.tv_sec - before.ru_stime.tv_sec;
+  r->ru.ru_stime.tv_usec += after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+  r->ru.ru_maxrss = max(r->ru.ru_maxrss, after.ru_maxrss);
+  r->ru.ru_nvcsw += after.ru_nvcsw - before.ru_nvcsw;
+  r->ru.ru_nivcsw += after.ru_nivcsw - before.ru_nivcsw;
+  return true;
+}
+
+/* Run `argv` as a plain child of the shell started with posix_spawn, to
+ * compare with launching it as a job. Returns false if it could not be
+ * started or has been killed by a signal. */
+static bool spawnrun(const char *file, char **argv, results_t *r) {
+  struct timespec start, end;
+  sigset_t mask;
+  pid_t pid;
+  int status, error;
+
+  fgsignal = 0;
+  /* Keep SIGCHLD handler from reaping the child. */
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((error = posix_spawn(&pid, file, NULL, NULL, argv, environ))) {
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    msg("bench: %s: %s\n", argv[0], strerror(error));
+    return false;
+  }
+  while (waitpid(pid, &status, WUNTRACED) < 0)
+    if (errno != EINTR)
+      unix_error("waitpid error");
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  /* It's not a job, so it cannot be resumed later. */
+  if (WIFSTOPPED(status)) {
+    fgsignal = WSTOPSIG(status);
+    Kill(pid, SIGKILL);
+    Kill(pid, SIGCONT);
+    (void)Waitpid(pid, &status, 0);
+  } else if (WIFSIGNALED(status)) {
+    fgsignal = WTERMSIG(status);
+  }
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (fgsignal)
+    return false;
+  if (r)
+    r->spawn[r->nspawn++] = elapsed(&start, &end);
+  return true;
+}
+
+/* Print minimum, median, 99th percentile and maximum of `n` samples. */
+static void summary(const char *name, double *v, int n, const char *note) {
+  char a[16], b[16], c[16], d[16];
+
+  qsort(v, n, sizeof(double), doublecmp);
+  msg("  %-7s min %s  median %s  p99 %s  max %s%s\n", name,
+      fmtms(v[0], a, sizeof(a)), fmtms(percentile(v, n, 0.5), b, sizeof(b)),
+      fmtms(percentile(v, n, 0.99), c, sizeof(c)),
+      fmtms(v[n - 1], d, sizeof(d)), note);
+}
+
+static void report(const char *cmdline, results_t *r, int n) {
+  char a[16], b[16], c[16], d[16], e[16], f[16];
+  double *w = r->wall, sum = 0, var = 0;
+
+  for (int i = 0; i < n; i++)
+    sum += w[i];
+  double mean = sum / n;
+  for (int i = 0; i < n; i++)
+    var += (w[i] - mean) * (w[i] - mean);
+  double sd = n > 1 ? sqrt(var / (n - 1)) : 0;
+
+  qsort(w, n, sizeof(double), doublecmp);
+  msg("bench: %d runs of '%s'\n", n, cmdline);
+  msg("  wall    min %s  median %s  p99 %s  max %s  mean %s +- %s\n",
+      fmtms(w[0], a, sizeof(a)), fmtms(percentile(w, n, 0.5), b, sizeof(b)),
+      fmtms(percentile(w, n, 0.99), c, sizeof(c)),
+      fmtms(w[n - 1], d, sizeof(d)), fmtms(mean, e, sizeof(e)),
+      fmtms(sd, f, sizeof(f)));
+
+  if (r->nlaunch > 0)
+    summary("launch", r->launch, r->nlaunch, "  (fork until execve)");
+  if (r->nspawn > 0)
+    summary("spawn", r->spawn, r->nspawn, "  (wall, posix_spawn)");
+
+  msg("  usage   user %s  sys %s  vcsw %.1f  ivcsw %.1f per run, "
+      "maxrss %s\n",
+      fmtms(tvms(&r->ru.ru_utime) / n, a, sizeof(a)),
+      fmtms(tvms(&r->ru.ru_stime) / n, b, sizeof(b)),
+      (double)r->ru.ru_nvcsw / n, (double)r->ru.ru_nivcsw / n,
+      fmtbytes(r->ru.ru_maxrss * 1024.0, c, sizeof(c)));
+
+  /* Tukey's fences: runs far above the upper quartile are likely disturbed
+   * by something else going on in the system. */
+  double q1 = percentile(w, n, 0.25), q3 = percentile(w, n, 0.75);
+  double iqr = q3 - q1;
+  int mild = 0, severe = 0;
+  for (int i = 0; i < n; i++) {
+    if (w[i] > q3 + 3 * iqr)
+      severe++;
+    else if (w[i] > q3 + 1.5 * iqr)
+      mild++;
+  }
+  if (mild + severe > 0)
+    msg("  outliers %d mild and %d severe (%.0f%%) above %s\n", mild, severe,
+        100.0 * (mild + severe) / n, fmtms(q3 + 1.5 * iqr, a, sizeof(a)));
+}
+
+/* Evaluate `cmdline` `warmup` times and then `n` times measuring each run
+ * from parsing until the foreground job has finished, i.e. the way the user
+ * experiences it. Usage of resources is taken from all children reaped in
+ * the meantime, so it includes background jobs that have finished too.
+ * With `spawn` each run is followed by one that starts the command with
+ * posix_spawn instead, which only works for a single external command. */
+void bench(const char *cmdline, int n, int warmup, bool spawn) {
+  results_t r = {0};
+  char *line = strdup(cmdline);
+  int ntokens;
+  token_t *argv = tokenize(line, &ntokens);
+  const char *file = NULL;
+  bool ok = true;
+
+  if (spawn) {
+    for (int i = 0; i < ntokens; i++)
+      if (!string_p(argv[i]))
+        ntokens = -1;
+    if (ntokens <= 0 || (file = findcommand(argv[0])) == NULL) {
+      msg("bench: -s works only for a single external command\n");
+      free(argv);
+      free(line);
+      return;
+    }
+  }
+
+  launchtime = Mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  r.wall = Malloc(sizeof(double) * n);
+  r.launch = Malloc(sizeof(double) * n);
+  r.spawn = Malloc(sizeof(double) * n);
+
+  for (int i = 0; i < warmup && ok; i++)
+    ok = run(cmdline, NULL, i) && (!file || spawnrun(file, argv, NULL));
+  for (int i = 0; i < n && ok; i++)
+    ok = run(cmdline, &r, i) && (!file || spawnrun(file, argv, &r));
+
+  if (!ok && fgsignal)
+    msg("bench: interrupted by signal %d\n", fgsignal);
+  else if (ok)
+    report(cmdline, &r, n);
+
+  Munmap(launchtime, sizeof(long));
+  launchtime = NULL;
+  free(r.wall);
+  free(r.launch);
+  free(r.spawn);
+  free(argv);
+  free(line);
+}
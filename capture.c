@@ -0,0 +1,153 @@
+#include "shell.h"
+
+#ifdef LINUX
+#include <asm/unistd.h>
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+int capture = 0; /* KiB of output kept for each background job, 0 - none */
+
+/* Output of a background job is read from a pipe by the event loop and kept
+ * in a ring buffer backed by anonymous memory file. */
+struct capture {
+  int pipe;      /* read end of the pipe, -1 once all writers are gone */
+  int memfd;     /* backs the buffer */
+  char *buf;     /* buffer mapped from `memfd` */
+  size_t size;   /* ... and its size */
+  uint64_t head; /* number of bytes written to the buffer so far */
+  bool echo;     /* pass new output through to the terminal as well */
+};
+
+static capture_t *pending = NULL; /* not yet claimed by a job */
+
+/* Reads done at once, so that a job writing faster than the shell can keep
+ * up does not starve other events. The rest is read on the next wakeup. */
+#define MAXREADS 16
+
+/* Move whatever is waiting in the pipe into the buffer. */
+static void drain(int fd, void *arg) {
+  capture_t *c = arg;
+  char data[PIPE_BUF * 16];
+  ssize_t n;
+
+  for (int i = 0; i < MAXREADS && (n = read(fd, data, sizeof(data))) > 0;
+       i++) {
+    if (c->echo)
+      (void)write(STDOUT_FILENO, data, n);
+    /* Only the tail fits if there's more than the buffer can hold. */
+    char *s = data + max(n - (ssize_t)c->size, 0);
+    for (ssize_t left = n - (s - data); left > 0;) {
+      size_t pos = c->head % c->size;
+      size_t len = min((size_t)left, c->size - pos);
+      memcpy(c->buf + pos, s, len);
+      c->head += len;
+      s += len;
+      left -= len;
+    }
+  }
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    delevent(fd);
+    Close(fd);
+    c->pipe = -1;
+  }
+}
+
+/* Called before processes of a background job are created, if 'capture'
+ * option is set. Returns write end of a pipe that should become their
+ * standard output and error, or -1 if output is not to be captured. */
+int opencapture(void) {
+  int fds[2];
+
+  if (capture <= 0)
+    return -1;
+
+  freecapture(pending);
+
+  capture_t *c = malloc(sizeof(capture_t));
+  c->size = capture * 1024L;
+  c->head = 0;
+  c->echo = false;
+  c->memfd = syscall(__NR_memfd_create, "capture", MFD_CLOEXEC);
+  if (c->memfd < 0)
+    unix_error("memfd_create error");
+  Ftruncate(c->memfd, c->size);
+  c->buf = Mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->memfd, 0);
+
+  Pipe(fds);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  c->pipe = fds[0];
+  addevent(c->pipe, drain, c);
+
+  pending = c;
+  return fds[1];
+}
+
+/* Hand over capture created by last `opencapture` to a new job. */
+capture_t *takecapture(void) {
+  capture_t *c = pending;
+  pending = NULL;
+  return c;
+}
+
+void freecapture(capture_t *c) {
+  if (c == NULL)
+    return;
+  if (c->pipe >= 0) {
+    delevent(c->pipe);
+    Close(c->pipe);
+  }
+  Munmap(c->buf, c->size);
+  Close(c->memfd);
+  free(c);
+}
+
+/* Write captured output (or its tail if the buffer has wrapped around). */
+void showcapture(capture_t *c) {
+  size_t pos = c->head % c->size;
+
+  if (c->head > c->size)
+    (void)write(STDOUT_FILENO, c->buf + pos, c->size - pos);
+  (void)write(STDOUT_FILENO, c->buf, c->head > c->size ? pos : c->head);
+}
+
+/* Start or stop passing new output to the terminal, e.g. when the job is
+ * moved to foreground and back. Output the job has managed to write so far
+ * is flushed before it stops. */
+void echocapture(capture_t *c, bool on) {
+  if (c == NULL)
+    return;
+  if (!on && c->pipe >= 0)
+    drain(c->pipe, c);
+  c->echo = on;
+}
+
+/* Show captured output and keep writing new output of the job until it
+ * closes its end of the pipe or the user presses Enter or ^C. */
+void followcapture(capture_t *c) {
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  showcapture(c);
+  c->echo = true;
+
+  bool input = false;
+  interrupted = 0;
+  while (c->pipe >= 0 && !interrupted && !input)
+    input = waitevents(STDIN_FILENO, &mask);
+  c->echo = false;
+  interrupted = 0;
+
+  /* Consume the line that has ended following. */
+  if (input) {
+    char buf[MAXLINE];
+    (void)read(STDIN_FILENO, buf, sizeof(buf));
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
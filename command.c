@@ -1,4 +1,5 @@
 #include "shell.h"
+#include "rio.h"
 
 typedef int (*func_t)(char **argv);
 
@@ -7,6 +8,126 @@ typedef struct {
   func_t func;
 } command_t;
 
+typedef struct {
+  const char *name;
+  int *valuep;                  /* numeric option */
+  int min, max;                 /* ... and the range of values it takes */
+  char **strp;                  /* textual option, NULL if not set */
+  bool (*valid)(const char *s); /* checks value given to textual option */
+} option_t;
+
+static bool validcpus(const char *s) {
+  int cpu;
+  return cpulist(s, &cpu, 1) > 0;
+}
+
+static bool validnice(const char *s) {
+  char *end;
+  long nice = strtol(s, &end, 10);
+  return end != s && *end == '\0' && nice >= -20 && nice <= 19;
+}
+
+static bool validioprio(const char *s) {
+  return parseioprio(s) >= 0;
+}
+
+/* Shell options that can be changed with 'set'. */
+static option_t options[] = {
+  {"placement", &placement, 0, 1},
+  {"autonice", &autonice, 0, 1},
+  {"maxjobs", &maxjobs, 0, INT_MAX},
+  {"killtimeout", &killtimeout, 0, INT_MAX},
+  {"notify", &notify, 0, 1},
+  {"subreaper", &subreaper, 0, 1},
+  {"singleflight", &singleflight, 0, 1},
+  {"capture", &capture, 0, 1 << 20},
+  {"maxload", &maxload, 0, INT_MAX},
+  {"maxpressure", &maxpressure, 0, 100},
+  {"memguard", &memguard, 0, 100},
+  {"minfree", &minfree, 0, INT_MAX},
+  {"pathcache", &pathcache, 0, 1},
+  {"fgcpus", NULL, 0, 0, &fgcpus, validcpus},
+  {"bgcpus", NULL, 0, 0, &bgcpus, validcpus},
+  {"fgnice", NULL, 0, 0, &fgnice, validnice},
+  {"bgnice", NULL, 0, 0, &bgnice, validnice},
+  {"fgio", NULL, 0, 0, &fgio, validioprio},
+  {"bgio", NULL, 0, 0, &bgio, validioprio},
+  {NULL, NULL},
+};
+
+/* Parse job specification, i.e. '%n'. Returns -1 if malformed. */
+static int jobspec(const char *arg) {
+  char *end;
+
+  if (arg == NULL || arg[0] != '%' || !isdigit(arg[1]))
+    return -1;
+  int j = strtol(arg + 1, &end, 10);
+  return *end ? -1 : j;
+}
+
+static const struct {
+  const char *name;
+  int signo;
+} signals[] = {
+  {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+  {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+  {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+  {NULL, 0},
+};
+
+/* Parse signal given by number or name, with or without 'SIG' prefix.
+ * Returns -1 if it's not known. */
+static int parsesignal(const char *arg) {
+  char *end;
+
+  if (isdigit(arg[0])) {
+    int signo = strtol(arg, &end, 10);
+    return (*end || signo >= NSIG) ? -1 : signo;
+  }
+  if (!strncasecmp(arg, "SIG", 3))
+    arg += 3;
+  for (int i = 0; signals[i].name; i++)
+    if (!strcasecmp(arg, signals[i].name))
+      return signals[i].signo;
+  return -1;
+}
+
+/* Parse selection of jobs, i.e. '%n', '%n-%m', '%all', '%running' or
+ * '%stopped', the latter three optionally followed by '?substring' of job's
+ * command. '%?substring' is a shorthand for '%all?substring'. */
+static bool jobselection(const char *arg, jobsel_t *sel) {
+  static const struct {
+    const char *name;
+    int state;
+  } states[] = {{"all", ALL}, {"running", RUNNING}, {"stopped", STOPPED}};
+  char *end;
+
+  *sel = (jobsel_t){.first = BG, .last = INT_MAX, .state = ALL};
+
+  if (arg == NULL || *arg++ != '%')
+    return false;
+
+  if (isdigit(*arg)) {
+    sel->first = sel->last = strtol(arg, &end, 10);
+    if (*end == '-')
+      sel->last = strtol(end + (end[1] == '%' ? 2 : 1), &end, 10);
+    return *end == '\0' && sel->first <= sel->last;
+  }
+
+  size_t len = strcspn(arg, "?");
+  if (len > 0) {
+    int i;
+    for (i = 0; i < 3 && strncmp(arg, states[i].name, len); i++)
+      continue;
+    if (i == 3 || states[i].name[len] != '\0')
+      return false;
+    sel->state = states[i].state;
+  }
+  if (arg[len] == '?')
+    sel->pattern = arg + len + 1;
+  return true;
+}
+
 static int do_quit(char **argv) {
   shutdownjobs();
   exit(EXIT_SUCCESS);
@@ -29,71 +150,1212 @@ static int do_chdir(char **argv) {
   return 0;
 }
 
+/* Longest duration accepted (in milliseconds), about 68 years. */
+#define MAXDURATION (INT_MAX * 1e3)
+
+/* Parse duration given as a decimal number with an optional unit suffix,
+ * i.e. 'ms', 's' (default), 'm', 'h' or 'd'. Returns it in milliseconds,
+ * or -1 if malformed. Durations that are not zero but would round down to
+ * it, and thus disable timers, are rejected, just as overly long ones. */
+static long parseduration(const char *arg) {
+  static const struct {
+    const char *suffix;
+    double ms;
+  } units[] = {{"", 1e3},  {"ms", 1},     {"s", 1e3},   {"m", 60e3},
+               {"h", 3600e3}, {"d", 86400e3}, {NULL, 0}};
+  char *end;
+
+  double value = strtod(arg, &end);
+  if (end == arg || !(value >= 0)) /* NaN too */
+    return -1;
+  for (int i = 0; units[i].suffix; i++) {
+    if (strcmp(end, units[i].suffix))
+      continue;
+    double ms = value * units[i].ms;
+    if ((ms > 0 && ms < 1) || ms > MAXDURATION)
+      return -1;
+    return ms;
+  }
+  return -1;
+}
+
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -l' list processes of each job as well
+ * 'jobs -t [period]' refresh table of processes in place until Enter or ^C
  */
 static int do_jobs(char **argv) {
-  watchjobs(ALL);
+  if (argv[0] && !strcmp(argv[0], "-t")) {
+    long period = argv[1] ? parseduration(argv[1]) : 1000;
+    if (period <= 0) {
+      msg("jobs: invalid refresh period '%s'\n", argv[1]);
+      return 1;
+    }
+    topjobs(period);
+    return 0;
+  }
+
+  bool verbose = argv[0] && !strcmp(argv[0], "-l");
+  watchjobs(ALL, verbose);
+  watchschedules();
   return 0;
 }
 
+/*
+ * Display or change shell options.
+ * 'set' list all options with their values
+ * 'set name' or 'set -o name' turn option on
+ * 'set +o name' turn option off
+ * 'set name=value' assign value to option, empty value unsets it
+ */
+static int do_set(char **argv) {
+  if (argv[0] == NULL) {
+    for (option_t *opt = options; opt->name; opt++) {
+      if (opt->valuep)
+        msg("%s=%d\n", opt->name, *opt->valuep);
+      else
+        msg("%s=%s\n", opt->name, *opt->strp ? *opt->strp : "");
+    }
+    return 0;
+  }
+
+  for (; argv[0]; argv++) {
+    const char *name = argv[0];
+    int value = 1;
+
+    if (!strcmp(argv[0], "-o") || !strcmp(argv[0], "+o")) {
+      value = argv[0][0] == '-';
+      if ((name = *++argv) == NULL) {
+        msg("set: option name expected\n");
+        return 1;
+      }
+    }
+
+    const char *eq = strchr(name, '=');
+    size_t len = eq ? eq - name : strlen(name);
+    option_t *opt;
+
+    for (opt = options; opt->name; opt++)
+      if (strlen(opt->name) == len && !strncmp(opt->name, name, len))
+        break;
+
+    if (opt->name == NULL) {
+      msg("set: no such option: %s\n", name);
+      return 1;
+    }
+
+    if (opt->valuep) {
+      char *end = NULL;
+      long n = value;
+      if (eq)
+        n = strtol(eq + 1, &end, 10);
+      if (end && (end == eq + 1 || *end)) {
+        msg("set: invalid value of %.*s: %s\n", (int)len, name, eq + 1);
+        return 1;
+      }
+      if (n < opt->min || n > opt->max) {
+        msg("set: %.*s must be between %d and %d\n", (int)len, name,
+            opt->min, opt->max);
+        return 1;
+      }
+      *opt->valuep = n;
+    } else if (eq) {
+      if (eq[1] && !opt->valid(eq + 1)) {
+        msg("set: invalid value of %.*s: %s\n", (int)len, name, eq + 1);
+        return 1;
+      }
+      free(*opt->strp);
+      *opt->strp = eq[1] ? strdup(eq + 1) : NULL;
+    } else {
+      msg("set: option requires a value: %s\n", name);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Parse argument of 'fg' or 'bg', which is job number with or without '%',
+ * or a selection of jobs. Without argument it selects all jobs. */
+static bool resumeselection(const char *arg, jobsel_t *sel) {
+  if (arg == NULL || *arg == '%')
+    return jobselection(arg ? arg : "%all", sel);
+  char *end;
+  *sel = (jobsel_t){.state = ALL};
+  sel->first = sel->last = strtol(arg, &end, 10);
+  return *end == '\0';
+}
+
+/* Highest numbered job that can be resumed, i.e. it's not queued. */
+static bool lastresumable(int j, void *arg) {
+  if (peekjobstate(j) == QUEUED)
+    return false;
+  *(int *)arg = j;
+  return true;
+}
+
 /*
  * Move running or stopped background job to foreground.
- * 'fg' choose highest numbered job
+ * 'fg' choose highest numbered job that is not queued
  * 'fg n' choose job number n
+ * 'fg %selection' choose highest numbered job of the selection
  */
 static int do_fg(char **argv) {
-  int j = argv[0] ? atoi(argv[0]) : -1;
+  jobsel_t sel;
+  int j = -1;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, FG, &mask))
-    msg("fg: job not found: %s\n", argv[0]);
+  if (resumeselection(argv[0], &sel))
+    (void)foreachjob(&sel, lastresumable, &j);
+  if (j < 0 || !resumejob(j, FG, &mask)) {
+    if (argv[0])
+      msg("fg: job not found: %s\n", argv[0]);
+    else
+      msg("fg: job not found\n");
+  }
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
+/* Parse share of CPU given in percent, with or without '%' sign. 'off' is
+ * the same as 100%. Returns -1 if malformed. */
+static int parseshare(const char *arg) {
+  char *end;
+
+  if (!strcmp(arg, "off"))
+    return 100;
+  long share = strtol(arg, &end, 10);
+  if (end == arg || (*end == '%' && *++end) || *end)
+    return -1;
+  return share > 0 && share <= 100 ? share : -1;
+}
+
+typedef struct {
+  sigset_t *mask;
+  int cpushare; /* share for 'throttle' or -1 if not given */
+} bgopts_t;
+
+static bool bgjob(int j, void *arg) {
+  bgopts_t *opts = arg;
+
+  if (!resumejob(j, BG, opts->mask))
+    return false;
+  if (opts->cpushare > 0)
+    (void)throttlejob(j, opts->cpushare);
+  return true;
+}
+
 /*
- * Make stopped background job running.
+ * Make stopped background jobs running.
  * 'bg' choose highest numbered job
  * 'bg n' choose job number n
+ * 'bg %selection...' choose all jobs of the selections
+ * 'bg --cpu=share ...' throttle them to given CPU share, e.g. '--cpu=30%'
  */
 static int do_bg(char **argv) {
-  int j = argv[0] ? atoi(argv[0]) : -1;
+  sigset_t mask;
+  bgopts_t opts = {.mask = &mask, .cpushare = -1};
+
+  if (argv[0] && !strncmp(argv[0], "--cpu=", 6)) {
+    if ((opts.cpushare = parseshare(argv[0] + 6)) < 0) {
+      msg("bg: invalid CPU share: %s\n", argv[0] + 6);
+      return 1;
+    }
+    argv++;
+  }
+
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  if (argv[0] == NULL) {
+    jobsel_t sel;
+    int j = -1;
+    (void)resumeselection(NULL, &sel);
+    (void)foreachjob(&sel, lastresumable, &j);
+    if (j < 0 || !bgjob(j, &opts))
+      msg("bg: job not found\n");
+  }
+
+  for (; argv[0]; argv++) {
+    jobsel_t sel;
+    if (!resumeselection(argv[0], &sel)) {
+      msg("bg: bad job specification: %s\n", argv[0]);
+      continue;
+    }
+    /* Only stopped jobs need to be resumed. */
+    if (sel.first != sel.last && sel.state == ALL)
+      sel.state = STOPPED;
+    if (foreachjob(&sel, bgjob, &opts) == 0)
+      msg("bg: job not found: %s\n", argv[0]);
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return 0;
+}
+
+static bool throttleone(int j, void *arg) {
+  int share = *(int *)arg, old;
+
+  if (share > 0 && share < 100 && peekjobstate(j) == STOPPED) {
+    msg("throttle: job %d is suspended, resume it with 'bg --cpu=%d%%'\n",
+        j, share);
+    return true;
+  }
+  if ((old = throttlejob(j, share)) < 0)
+    return false;
+  if (share < 0)
+    msg("[%d] cpu=%d%% '%s'\n", j, old > 0 ? old : 100, jobcmd(j));
+  return true;
+}
+
+/*
+ * Cap CPU share of background jobs by stopping and continuing them.
+ * 'throttle %selection... share' e.g. 'throttle %1 30%'
+ * 'throttle %selection... off' lift the cap
+ * 'throttle %selection...' show current shares
+ */
+static int do_throttle(char **argv) {
+  int share = -1, n = 0;
+
+  while (argv[n] && argv[n][0] == '%')
+    n++;
+  if (n == 0 || (argv[n] && argv[n + 1])) {
+    msg("throttle: usage: throttle %%selection... [share | off]\n");
+    return 1;
+  }
+  if (argv[n] && (share = parseshare(argv[n])) < 0) {
+    msg("throttle: invalid CPU share: %s\n", argv[n]);
+    return 1;
+  }
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask))
-    msg("bg: job not found: %s\n", argv[0]);
+
+  for (int i = 0; i < n; i++) {
+    jobsel_t sel;
+    if (!jobselection(argv[i], &sel))
+      msg("throttle: bad job specification: %s\n", argv[i]);
+    else if (foreachjob(&sel, throttleone, &share) == 0)
+      msg("throttle: job not found: %s\n", argv[i]);
+  }
+
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
 /*
- * Make stopped background job running.
- * 'bg' choose highest numbered job
- * 'bg n' choose job number n
+ * Show output of a background job kept with 'capture' option, which is
+ * available until the job number gets reused.
+ * 'output %n' write the output (or its tail) captured so far
+ * 'output -f %n' then keep writing new output until Enter or ^C
+ */
+static int do_output(char **argv) {
+  bool follow = argv[0] && !strcmp(argv[0], "-f");
+  capture_t *c;
+
+  if (follow)
+    argv++;
+  if (argv[0] == NULL || argv[1]) {
+    msg("output: usage: output [-f] %%n\n");
+    return 1;
+  }
+  if ((c = jobcapture(jobspec(argv[0]))) == NULL) {
+    msg("output: no output captured for %s\n", argv[0]);
+    return 1;
+  }
+
+  if (follow)
+    followcapture(c);
+  else
+    showcapture(c);
+  return 0;
+}
+
+/*
+ * 'coproc name cmd...' start a coprocess that other commands talk to with
+ *   redirections, i.e. 'echo 2+2 >%name' and 'head -1 <%name'
+ * 'coproc -c name' close the coprocess input, so that it gets end of file
+ */
+static int do_coproc(char **argv) {
+  int fds[2];
+
+  if (argv[0] && !strcmp(argv[0], "-c") && argv[1] && !argv[2]) {
+    if ((fds[0] = coprocfd(argv[1], false)) < 0) {
+      msg("coproc: no coprocess %s\n", argv[1]);
+      return 1;
+    }
+    (void)shutdown(fds[0], SHUT_WR);
+    return 0;
+  }
+
+  if (argv[0] == NULL || argv[1] == NULL) {
+    msg("coproc: usage: coproc name command [args...]\n");
+    return 1;
+  }
+  if (coprocfd(argv[0], true) >= 0) {
+    msg("coproc: coprocess %s already exists\n", argv[0]);
+    return 1;
+  }
+
+  /* One socket works both ways, so it replaces a pair of pipes. */
+  Socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  int j = spawnjob(argv + 1, fds[1]);
+  Close(fds[1]);
+  setcoproc(j, argv[0], fds[0]);
+  msg("[%d] running '%s' as %%%s\n", j, jobcmd(j), argv[0]);
+  return 0;
+}
+
+static bool signaljob(int j, void *arg) {
+  return killjob(j, *(int *)arg);
+}
+
+/*
+ * Send a signal (SIGTERM by default) to background jobs.
+ * 'kill [-signal | -s signal] %selection...'
+ * Without '%' arguments the command is left to kill(1).
  */
 static int do_kill(char **argv) {
+  int signo = SIGTERM;
+
+  if (argv[0] && !strcmp(argv[0], "-s") && argv[1]) {
+    signo = parsesignal(argv[1]);
+    argv += 2;
+  } else if (argv[0] && argv[0][0] == '-') {
+    signo = parsesignal(argv[0] + 1);
+    argv++;
+  }
+
   if (!argv[0])
     return -1;
-  if (*argv[0] != '%')
+  for (int i = 0; argv[i]; i++)
+    if (*argv[i] != '%')
+      return -1;
+
+  if (signo < 0) {
+    msg("kill: unknown signal\n");
+    return 1;
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (; argv[0]; argv++) {
+    jobsel_t sel;
+    if (!jobselection(argv[0], &sel))
+      msg("kill: bad job specification: %s\n", argv[0]);
+    else if (foreachjob(&sel, signaljob, &signo) == 0)
+      msg("kill: job not found: %s\n", argv[0]);
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  return 0;
+}
+
+/*
+ * Wait for background jobs to finish.
+ * 'wait' waits for all running and queued jobs
+ * 'wait %n...' waits for given jobs and returns exit code of the last one
+ * 'wait -n [%n...]' returns exit code of the first job that has finished
+ */
+static int do_wait(char **argv) {
+  bool any = false;
+
+  if (argv[0] && !strcmp(argv[0], "-n")) {
+    any = true;
+    argv++;
+  }
+
+  int njob = 0;
+  while (argv[njob])
+    njob++;
+
+  int job[max(njob, 1)];
+  for (int i = 0; i < njob; i++) {
+    if ((job[i] = jobspec(argv[i])) < 0) {
+      msg("wait: usage: wait [-n] [%%n...]\n");
+      return 2;
+    }
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  int code = waitjobs(job, njob, any, &mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  if (code < 0) {
+    msg("wait: job not found\n");
+    return 127;
+  }
+  /* Just like in other shells plain 'wait' succeeds, unless it gave up. */
+  if (njob > 0 || any || code == 128 + SIGINT || code == 128 + SIGTSTP)
+    return code;
+  return 0;
+}
+
+typedef struct {
+  const char *name; /* builtin name for error messages */
+  const char *arg;  /* argument as given by the user */
+  bool failed;      /* set if applying to any process failed */
+  union {
+    const char *cpus;
+    int nice;
+    int ioprio;
+  };
+} sched_t;
+
+static void report(sched_t *sched, pid_t pid) {
+  msg("%s: %d: %s\n", sched->name, pid, strerror(errno));
+  sched->failed = true;
+}
+
+static void taskset(pid_t pid, void *arg) {
+  sched_t *sched = arg;
+  if (!setcpus(pid, sched->cpus))
+    report(sched, pid);
+}
+
+static void renice(pid_t pid, void *arg) {
+  sched_t *sched = arg;
+  if (!setnice(pid, sched->nice))
+    report(sched, pid);
+}
+
+static void ionice(pid_t pid, void *arg) {
+  sched_t *sched = arg;
+  if (!setioprio(pid, sched->ioprio))
+    report(sched, pid);
+}
+
+/* Scheduling builtins handle job specifications only. Otherwise the system
+ * utility of the same name gets executed. */
+static bool has_jobspec(char **argv) {
+  for (; argv[0]; argv++)
+    if (argv[0][0] == '%')
+      return true;
+  return false;
+}
+
+/* Apply scheduling change to all processes of jobs given in `argv`. */
+static int schedjobs(char **argv, sched_t *sched,
+                     void (*func)(pid_t pid, void *arg)) {
+  if (argv[0] == NULL) {
+    msg("%s: job expected\n", sched->name);
+    return 1;
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  for (; argv[0]; argv++) {
+    if (!foreachproc(jobspec(argv[0]), func, sched)) {
+      msg("%s: job not found: %s\n", sched->name, argv[0]);
+      sched->failed = true;
+    }
+  }
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return sched->failed;
+}
+
+/*
+ * Restrict job's processes to given CPUs.
+ * 'taskset cpulist %n...' e.g. 'taskset 0-3,8 %1'
+ * Without job specification runs taskset(1) utility.
+ */
+static int do_taskset(char **argv) {
+  sched_t sched = {.name = "taskset", .cpus = argv[0]};
+  if (!has_jobspec(argv))
+    return -1;
+  if (argv[0] == NULL) {
+    msg("taskset: cpu list expected\n");
+    return 1;
+  }
+  return schedjobs(argv + 1, &sched, taskset);
+}
+
+/*
+ * Change nice value of job's processes.
+ * 'renice value %n...'
+ * Without job specification runs renice(1) utility.
+ */
+static int do_renice(char **argv) {
+  sched_t sched = {.name = "renice"};
+  char *end = NULL;
+  if (!has_jobspec(argv))
+    return -1;
+  if (argv[0])
+    sched.nice = strtol(argv[0], &end, 10);
+  if (end == NULL || end == argv[0] || *end) {
+    msg("renice: nice value expected\n");
+    return 1;
+  }
+  return schedjobs(argv + 1, &sched, renice);
+}
+
+/*
+ * Change I/O scheduling class and level of job's processes.
+ * 'ionice class[:level] %n...' where class is none, realtime, best-effort
+ * or idle (abbreviations and numbers 0-3 are accepted as well)
+ * Without job specification runs ionice(1) utility.
+ */
+static int do_ionice(char **argv) {
+  sched_t sched = {.name = "ionice"};
+  if (!has_jobspec(argv))
     return -1;
+  if (argv[0] == NULL || (sched.ioprio = parseioprio(argv[0])) < 0) {
+    msg("ionice: class[:level] expected\n");
+    return 1;
+  }
+  return schedjobs(argv + 1, &sched, ionice);
+}
+
+typedef struct {
+  char **argv; /* arguments given after ':::' */
+  rio_t *rio;  /* or read line by line from a file */
+} argsrc_t;
+
+/* Returns next argument for 'parallel' or NULL if there are no more. */
+static char *nextarg(argsrc_t *src) {
+  char line[MAXLINE];
+
+  if (src->rio == NULL)
+    return *src->argv ? strdup(*src->argv++) : NULL;
+
+  if (rio_readlineb(src->rio, line, MAXLINE) <= 0)
+    return NULL;
+  line[strcspn(line, "\n")] = '\0';
+  return strdup(line);
+}
+
+/* Substitute '{}' in command template with `arg` (or append the argument). */
+static char **mkargv(char **template, int ntemplate, const char *arg) {
+  char **argv = malloc(sizeof(char *) * (ntemplate + 2));
+  bool used = false;
+
+  for (int i = 0; i < ntemplate; i++) {
+    char *s = template[i], *p;
+    argv[i] = NULL;
+    while ((p = strstr(s, "{}"))) {
+      char *prefix = strndup(s, p - s);
+      strapp(&argv[i], prefix);
+      strapp(&argv[i], arg);
+      free(prefix);
+      s = p + 2;
+      used = true;
+    }
+    strapp(&argv[i], s);
+  }
 
-  int j = atoi(argv[0] + 1);
+  argv[ntemplate] = used ? NULL : strdup(arg);
+  argv[ntemplate + 1] = NULL;
+  return argv;
+}
+
+static void freeargv(char **argv) {
+  for (char **p = argv; *p; p++)
+    free(*p);
+  free(argv);
+}
+
+/* Returns argument vector of the next job to start, or NULL if there are no
+ * more. The vector is released with `freeargv`. */
+typedef char **(*jobgen_t)(void *arg);
+
+typedef struct {
+  int total;        /* number of jobs started */
+  int failed;       /* ... and how many of them failed */
+  int nstatus[256]; /* how many jobs finished with given status */
+} jobstats_t;
+
+/* Limit of jobs run at once by 'parallel' and 'xargs'. */
+#define MAXPARALLEL 1024
+
+/* Keep up to `njobs` jobs produced by `next` running at once, until there
+ * are no more of them or the user hits ^C. */
+static void runjobs(int njobs, jobgen_t next, void *arg, jobstats_t *stats) {
+  int *running = malloc(sizeof(int) * njobs);
+  int nrunning = 0;
+  bool stop = false;
+  char **jobargv;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!killjob(j))
-    msg("kill: job not found: %s\n", argv[0]);
+  interrupted = 0;
+
+  for (;;) {
+    while (nrunning < njobs && !stop && (jobargv = next(arg))) {
+      running[nrunning++] = spawnjob(jobargv, -1);
+      freeargv(jobargv);
+      stats->total++;
+    }
+
+    if (nrunning == 0)
+      break;
+
+    (void)waitevents(-1, &mask);
+    runqueue();
+
+    /* Do not start new jobs on ^C and terminate running ones. */
+    if (interrupted) {
+      for (int i = 0; i < nrunning; i++)
+        (void)killjob(running[i], SIGTERM);
+      interrupted = 0;
+      stop = true;
+    }
+
+    for (int i = 0; i < nrunning; i++) {
+      int status;
+      if (jobstate(running[i], &status) != FINISHED)
+        continue;
+      stats->nstatus[status & 255]++;
+      if (status)
+        stats->failed++;
+      running[i--] = running[--nrunning];
+    }
+  }
+
   Sigprocmask(SIG_SETMASK, &mask, NULL);
+  free(running);
+}
+
+typedef struct {
+  char **template; /* command with '{}' placeholders */
+  int ntemplate;
+  argsrc_t src;
+} parallel_t;
+
+static char **nextparallel(void *arg) {
+  parallel_t *p = arg;
+  char *s = nextarg(&p->src);
+
+  if (s == NULL)
+    return NULL;
+  char **argv = mkargv(p->template, p->ntemplate, s);
+  free(s);
+  return argv;
+}
+
+/*
+ * Run a command for each argument keeping up to N jobs running at once.
+ * 'parallel [-j N] [-a file] command [args...] [::: arg...]'
+ * '{}' in the command is replaced by an argument, otherwise it's appended.
+ * Arguments are read line by line from standard input, unless given with
+ * ':::' or '-a'. Returns the number of failed jobs (but at most 101).
+ */
+static int do_parallel(char **argv) {
+  int njobs = min(sysconf(_SC_NPROCESSORS_ONLN), MAXPARALLEL);
+  const char *input = NULL;
+
+  for (; argv[0] && argv[0][0] == '-'; argv += 2) {
+    if (!strcmp(argv[0], "-j") && argv[1])
+      njobs = atoi(argv[1]);
+    else if (!strcmp(argv[0], "-a") && argv[1])
+      input = argv[1];
+    else
+      break;
+  }
+
+  int ntemplate = 0;
+  while (argv[ntemplate] && strcmp(argv[ntemplate], ":::"))
+    ntemplate++;
+
+  if (ntemplate == 0 || njobs < 1 || njobs > MAXPARALLEL) {
+    msg("parallel: usage: parallel [-j N] [-a file] command [args...] "
+        "[::: arg...]\n");
+    return 1;
+  }
+
+  /* Look up the command once, children will find it in the cache. */
+  if (findcommand(argv[0]) == NULL) {
+    msg("parallel: %s: %s\n", argv[0], strerror(errno));
+    return 127;
+  }
+
+  parallel_t p = {argv, ntemplate, {.argv = argv + ntemplate}};
+  rio_t rio;
+  int fd = -1;
+
+  if (*p.src.argv) {
+    p.src.argv++;
+  } else {
+    if (input && (fd = open(input, O_RDONLY | O_CLOEXEC)) < 0) {
+      msg("parallel: %s: %s\n", input, strerror(errno));
+      return 1;
+    }
+    rio_readinitb(&rio, input ? fd : STDIN_FILENO);
+    p.src.rio = &rio;
+  }
+
+  jobstats_t stats = {0};
+  runjobs(njobs, nextparallel, &p, &stats);
+
+  if (fd >= 0)
+    close(fd);
+
+  msg("parallel: %d jobs, %d failed", stats.total, stats.failed);
+  for (int i = 1; i < 256; i++)
+    if (stats.nstatus[i])
+      msg(", status=%d: %d", i, stats.nstatus[i]);
+  msg("\n");
+
+  return min(stats.failed, 101);
+}
+
+typedef struct {
+  char **template; /* command and its initial arguments */
+  int ntemplate;
+  long room;       /* bytes of argument space left for words */
+  int maxargs;     /* at most that many words per command, 0 if no limit */
+  rio_t rio;
+  char line[MAXLINE];
+  char *word;      /* next word to be consumed, or NULL */
+  bool toolong;    /* a word did not fit into argument space */
+} xargs_t;
+
+#define BLANKS " \t\n"
+
+/* Returns next blank separated word of input without consuming it. */
+static char *peekword(xargs_t *x) {
+  for (;;) {
+    if (x->word) {
+      x->word += strspn(x->word, BLANKS);
+      if (*x->word)
+        return x->word;
+    }
+    if (rio_readlineb(&x->rio, x->line, MAXLINE) <= 0)
+      return x->word = NULL;
+    x->word = x->line;
+  }
+}
+
+/* Consume the word returned by `peekword`. */
+static char *takeword(xargs_t *x) {
+  char *word = x->word;
+  size_t len = strcspn(word, BLANKS);
+
+  x->word += len;
+  if (*x->word)
+    x->word++;
+  return strndup(word, len);
+}
+
+/* Pack as many words as fit into argument space into a single command. */
+static char **nextxargs(void *arg) {
+  xargs_t *x = arg;
+  int n = x->ntemplate, size = n + 16;
+  long room = x->room;
+  char *word;
+
+  if (x->toolong || (word = peekword(x)) == NULL)
+    return NULL;
+
+  char **argv = malloc(sizeof(char *) * size);
+  for (int i = 0; i < n; i++)
+    argv[i] = strdup(x->template[i]);
+
+  while ((word = peekword(x)) &&
+         (x->maxargs == 0 || n - x->ntemplate < x->maxargs)) {
+    long len = strcspn(word, BLANKS) + 1 + sizeof(char *);
+    if (len > room)
+      break;
+    room -= len;
+    if (n + 1 == size)
+      argv = realloc(argv, sizeof(char *) * (size *= 2));
+    argv[n++] = takeword(x);
+  }
+  argv[n] = NULL;
+
+  if (n == x->ntemplate) {
+    x->toolong = true;
+    freeargv(argv);
+    return NULL;
+  }
+  return argv;
+}
+
+/* Returns number of bytes of argument space taken by `argv` strings. */
+static long argsize(char **argv) {
+  long size = 0;
+  for (; *argv; argv++)
+    size += strlen(*argv) + 1 + sizeof(char *);
+  return size;
+}
+
+/*
+ * Run a command with arguments read from standard input.
+ * 'xargs [-P N] [-n N] [command [args...]]'
+ * Words are packed into as few commands as the kernel's argument size limit
+ * allows, up to '-n' of them per command, and up to '-P' commands run at once.
+ * Returns 123 if any command failed, like its POSIX namesake.
+ */
+static int do_xargs(char **argv) {
+  static char *echo[] = {"echo", NULL};
+  int njobs = 1, maxargs = 0;
+
+  for (; argv[0] && argv[0][0] == '-'; argv += 2) {
+    if (!strcmp(argv[0], "-P") && argv[1])
+      njobs = atoi(argv[1]);
+    else if (!strcmp(argv[0], "-n") && argv[1])
+      maxargs = atoi(argv[1]);
+    else
+      break;
+  }
+
+  if ((argv[0] && argv[0][0] == '-') || njobs < 1 || njobs > MAXPARALLEL ||
+      maxargs < 0) {
+    msg("xargs: usage: xargs [-P N] [-n N] [command [args...]]\n");
+    return 1;
+  }
+
+  if (argv[0] == NULL)
+    argv = echo;
+
+  /* Look up the command once, children will find it in the cache. */
+  if (findcommand(argv[0]) == NULL) {
+    msg("xargs: %s: %s\n", argv[0], strerror(errno));
+    return 127;
+  }
+
+  /* Arguments share their space with the environment, and POSIX asks to
+   * leave 2048 bytes of headroom. */
+  xargs_t x = {.template = argv, .maxargs = maxargs};
+  while (x.template[x.ntemplate])
+    x.ntemplate++;
+  x.room = sysconf(_SC_ARG_MAX) - argsize(environ) - argsize(argv) - 2048;
+  rio_readinitb(&x.rio, STDIN_FILENO);
+
+  jobstats_t stats = {0};
+  runjobs(njobs, nextxargs, &x, &stats);
+
+  if (x.toolong) {
+    msg("xargs: argument list too long\n");
+    return 1;
+  }
+  return stats.failed ? 123 : 0;
+}
+
+/*
+ * Send a signal to the job if it has not finished in given time.
+ * 'timeout [-s signal] [-k duration] duration command...'
+ * With '-k' the job gets SIGKILL if it's still alive after a grace period.
+ */
+static int prefix_timeout(char **argv, int argc) {
+  int signo = SIGTERM;
+  long killafter = 0;
+  int i;
+
+  for (i = 0; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (!strcmp(argv[i], "-s"))
+      signo = parsesignal(argv[i + 1]);
+    else if (!strcmp(argv[i], "-k"))
+      killafter = parseduration(argv[i + 1]);
+    else
+      break;
+  }
+
+  long timeout = i < argc ? parseduration(argv[i++]) : -1;
 
+  if (i == argc || timeout < 0 || signo < 0 || killafter < 0) {
+    msg("timeout: usage: timeout [-s signal] [-k duration] duration "
+        "command...\n");
+    return -1;
+  }
+
+  jobopts.timeout = timeout;
+  jobopts.signal = signo;
+  jobopts.killafter = killafter;
+  return i;
+}
+
+/*
+ * Report time and resources used by each process of the job and in total.
+ * 'time command...'
+ */
+static int prefix_time(char **argv, int argc) {
+  if (argc == 0) {
+    msg("time: usage: time command...\n");
+    return -1;
+  }
+  jobopts.time = true;
+  return 0;
+}
+
+/*
+ * Sample CPU and I/O of each stage of the pipeline while it runs, and report
+ * which one is the bottleneck when it has finished.
+ * 'profile pipeline...'
+ */
+static int prefix_profile(char **argv, int argc) {
+  if (argc == 0) {
+    msg("profile: usage: profile pipeline...\n");
+    return -1;
+  }
+  jobopts.profile = true;
+  return 0;
+}
+
+/*
+ * Save standard output of the command, and replay it instead of running the
+ * command again with the same arguments and working directory. Values of
+ * environment variables and files the output depends on can be given too,
+ * so that it's run again once they change.
+ * 'memo [-e variable]... [-i file]... command...'
+ */
+static int prefix_memo(char **argv, int argc) {
+  uint64_t key = 1;
+  int i;
+
+  for (i = 0; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (!strcmp(argv[i], "-e"))
+      key = memoenv(key, argv[i + 1]);
+    else if (!strcmp(argv[i], "-i"))
+      key = memofile(key, argv[i + 1]);
+    else
+      break;
+  }
+
+  if (i == argc || argv[i][0] == '-') {
+    msg("memo: usage: memo [-e variable]... [-i file]... command...\n");
+    return -1;
+  }
+  jobopts.memo = key;
+  return i;
+}
+
+/* Parse time of day as 'hh:mm[:ss]' (today, or tomorrow if it has passed)
+ * or as '+duration' from now. */
+static bool parsetime(const char *arg, struct timespec *when) {
+  struct timespec now;
+  struct tm tm;
+  int h, m, s = 0, n = 0;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  if (arg[0] == '+') {
+    long ms = parseduration(arg + 1);
+    if (ms < 0)
+      return false;
+    when->tv_sec = now.tv_sec + ms / 1000;
+    when->tv_nsec = now.tv_nsec + ms % 1000 * 1000000;
+    if (when->tv_nsec >= 1000000000) {
+      when->tv_sec++;
+      when->tv_nsec -= 1000000000;
+    }
+    return true;
+  }
+
+  if ((sscanf(arg, "%d:%d%n:%d%n", &h, &m, &n, &s, &n) < 2) || arg[n] ||
+      h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59)
+    return false;
+
+  localtime_r(&now.tv_sec, &tm);
+  tm.tm_hour = h;
+  tm.tm_min = m;
+  tm.tm_sec = s;
+  tm.tm_isdst = -1;
+  time_t t = mktime(&tm);
+  if (t <= now.tv_sec) {
+    tm.tm_mday++;
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+  }
+  *when = (struct timespec){.tv_sec = t};
+  return true;
+}
+
+/*
+ * Run the command in background now and whenever any of the files (or files
+ * in the directories) change, once they have not changed for `delay`
+ * (200ms by default). If the previous run is still going, it's killed.
+ * 'watch-files [-o kill|skip|allow] [-w delay] path... -- command...'
+ */
+static int watch_command(char **argv, int argc, schedspec_t *spec) {
+  int i;
+
+  *spec = (schedspec_t){.overlap = OVERLAP_KILL, .delay = 200};
+
+  for (i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1] != '-'; i += 2) {
+    if (!strcmp(argv[i], "-o") && !strcmp(argv[i + 1], "kill"))
+      spec->overlap = OVERLAP_KILL;
+    else if (!strcmp(argv[i], "-o") && !strcmp(argv[i + 1], "skip"))
+      spec->overlap = OVERLAP_SKIP;
+    else if (!strcmp(argv[i], "-o") && !strcmp(argv[i + 1], "allow"))
+      spec->overlap = OVERLAP_ALLOW;
+    else if (!strcmp(argv[i], "-w"))
+      spec->delay = parseduration(argv[i + 1]);
+    else
+      break;
+  }
+
+  spec->paths = &argv[i];
+  while (i < argc && strcmp(argv[i], "--")) {
+    if (access(argv[i], F_OK) < 0) {
+      msg("watch-files: %s: %s\n", argv[i], strerror(errno));
+      return -1;
+    }
+    i++;
+  }
+  spec->npaths = &argv[i] - spec->paths;
+
+  /* Timer armed with zero delay would never fire. */
+  if (spec->npaths == 0 || i + 1 >= argc || spec->delay <= 0) {
+    msg("watch-files: usage: watch-files [-o kill|skip|allow] [-w delay] "
+        "path... -- command...\n");
+    return -1;
+  }
+  return i + 1;
+}
+
+/*
+ * Run the command in background periodically, or once at given time.
+ * 'every [-o skip|kill|allow] [-m run|skip] duration command...'
+ * 'at [-m run|skip] hh:mm[:ss]|+duration command...'
+ * 'every -d n', 'at -d n' or 'watch-files -d n' cancel schedule {n} listed
+ * by 'jobs'
+ * If the job started last time is still running, the new one is skipped
+ * ('-o skip'), started after the old one gets SIGTERM ('-o kill') or started
+ * anyway ('-o allow'). Jobs that cannot be started on time because the shell
+ * has been busy run late ('-m run') or are skipped ('-m skip').
+ * Returns number of words consumed, which is `argc` if there's nothing more
+ * to be done, 0 if it's not a schedule command, or -1 on error.
+ */
+int schedule_command(char **argv, int argc, schedspec_t *spec) {
+  bool every;
+  int i;
+
+  if (argc == 0 || (!(every = !strcmp(argv[0], "every")) &&
+                    strcmp(argv[0], "at") && strcmp(argv[0], "watch-files")))
+    return 0;
+
+  if (argc == 3 && !strcmp(argv[1], "-d")) {
+    if (!delschedule(atoi(argv[2]))) {
+      msg("%s: no schedule {%s}\n", argv[0], argv[2]);
+      return -1;
+    }
+    return argc;
+  }
+
+  if (!strcmp(argv[0], "watch-files"))
+    return watch_command(argv, argc, spec);
+
+  *spec = (schedspec_t){.overlap = OVERLAP_SKIP};
+
+  for (i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1]; i += 2) {
+    if (!strcmp(argv[i], "-o") && every && !strcmp(argv[i + 1], "skip"))
+      spec->overlap = OVERLAP_SKIP;
+    else if (!strcmp(argv[i], "-o") && every && !strcmp(argv[i + 1], "kill"))
+      spec->overlap = OVERLAP_KILL;
+    else if (!strcmp(argv[i], "-o") && every && !strcmp(argv[i + 1], "allow"))
+      spec->overlap = OVERLAP_ALLOW;
+    else if (!strcmp(argv[i], "-m") && !strcmp(argv[i + 1], "run"))
+      spec->skiplate = false;
+    else if (!strcmp(argv[i], "-m") && !strcmp(argv[i + 1], "skip"))
+      spec->skiplate = true;
+    else
+      break;
+  }
+
+  bool ok = i + 1 < argc;
+  if (ok && every)
+    ok = (spec->period = parseduration(argv[i])) > 0;
+  else if (ok)
+    ok = parsetime(argv[i], &spec->when);
+
+  if (!ok) {
+    if (every)
+      msg("every: usage: every [-o skip|kill|allow] [-m run|skip] duration "
+          "command...\n");
+    else
+      msg("at: usage: at [-m run|skip] hh:mm[:ss]|+duration command...\n");
+    return -1;
+  }
+  return i + 1;
+}
+
+#define MAXRUNS 1000000
+
+/*
+ * Run the command line `n` times (10 by default) in foreground after
+ * `warmup` runs (1 by default), and report statistics of wall time, time it
+ * takes to launch the command, and resources it uses. With '-s' every run
+ * is paired with one that starts the command with posix_spawn.
+ * 'bench [-s] [-n n] [-w warmup] command...'
+ * Returns number of words consumed, 0 if it's not 'bench', or -1 on error.
+ */
+int bench_command(char **argv, int argc, int *np, int *warmupp,
+                  bool *spawnp) {
+  int i;
+
+  if (argc == 0 || strcmp(argv[0], "bench"))
+    return 0;
+
+  *np = 10;
+  *warmupp = 1;
+  *spawnp = false;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-s"))
+      *spawnp = true;
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      *np = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      *warmupp = isdigit(argv[++i][0]) ? atoi(argv[i]) : -1;
+    else
+      break;
+  }
+
+  if (i == argc || argv[i][0] == '-' || *np <= 0 || *np > MAXRUNS ||
+      *warmupp < 0 || *warmupp > MAXRUNS) {
+    msg("bench: usage: bench [-s] [-n n] [-w warmup] command...\n");
+    return -1;
+  }
+  return i;
+}
+
+static struct {
+  const char *name;
+  int (*func)(char **argv, int argc);
+} prefixes[] = {
+  {"timeout", prefix_timeout},
+  {"time", prefix_time},
+  {"profile", prefix_profile},
+  {"memo", prefix_memo},
+  {NULL, NULL},
+};
+
+/* Prefix commands alter the way the rest of command line is run as a job,
+ * by setting `jobopts`. `argv` holds `argc` leading words of the command line.
+ * Returns how many words have been consumed (0 if it's not a prefix command),
+ * or -1 on error. */
+int prefix_command(char **argv, int argc) {
+  for (int i = 0; argc > 0 && prefixes[i].name; i++) {
+    if (strcmp(argv[0], prefixes[i].name))
+      continue;
+    int n = prefixes[i].func(&argv[1], argc - 1);
+    return n < 0 ? -1 : n + 1;
+  }
   return 0;
 }
 
 static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {NULL, NULL},
+  {"quit", do_quit},
+  {"cd", do_chdir},
+  {"jobs", do_jobs},
+  {"fg", do_fg},
+  {"bg", do_bg},
+  {"kill", do_kill},
+  {"wait", do_wait},
+  {"throttle", do_throttle},
+  {"output", do_output},
+  {"coproc", do_coproc},
+  {"set", do_set},
+  {"taskset", do_taskset},
+  {"renice", do_renice},
+  {"ionice", do_ionice},
+  {"parallel", do_parallel},
+  {"xargs", do_xargs},
+  {NULL, NULL},
 };
 
 int builtin_command(char **argv) {
@@ -107,29 +1369,87 @@ int builtin_command(char **argv) {
   return -1;
 }
 
+typedef struct {
+  char *name; /* command name */
+  char *file; /* executable file found in PATH */
+} pathent_t;
+
+int pathcache = 1; /* remember where commands have been found in PATH */
+
+static char *cached_path = NULL;   /* value of PATH cache is valid for */
+static pathent_t *pathents = NULL; /* commands looked up so far */
+static int npathents = 0;
+
+/* Find executable file for a command using PATH. Results are cached, so that
+ * commands started over and over again are looked up only once. The shell
+ * does it before starting a job, so its children find the command in the
+ * cache they inherit. With 'pathcache' off, e.g. while commands are being
+ * installed or removed, PATH is searched each time. Returns NULL and sets
+ * errno if not found. */
+const char *findcommand(const char *name) {
+  const char *path = getenv("PATH");
+  int error = ENOENT;
+
+  if (index(name, '/') || path == NULL)
+    return name;
+
+  if (!pathcache || cached_path == NULL || strcmp(cached_path, path)) {
+    for (int i = 0; i < npathents; i++) {
+      free(pathents[i].name);
+      free(pathents[i].file);
+    }
+    npathents = 0;
+    free(cached_path);
+    cached_path = strdup(path);
+  }
+
+  for (int i = 0; i < npathents; i++)
+    if (!strcmp(pathents[i].name, name))
+      return pathents[i].file;
+
+  /* For all paths in PATH construct an absolute path and check it. */
+  for (;;) {
+    size_t l = strcspn(path, ":");
+    char *candidate = l ? strndup(path, l) : strdup(".");
+    struct stat st;
+
+    strapp(&candidate, "/");
+    strapp(&candidate, name);
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (access(candidate, X_OK) == 0) {
+        /* Without the cache the file is kept until the next lookup. */
+        pathents = realloc(pathents, sizeof(pathent_t) * (npathents + 1));
+        pathents[npathents++] = (pathent_t){strdup(name), candidate};
+        return candidate;
+      }
+      /* Like execvp, report a file that cannot be executed if there's no
+       * other one. */
+      error = EACCES;
+    }
+    free(candidate);
+
+    if (path[l] == '\0')
+      break;
+    path += l + 1;
+  }
+
+  errno = error;
+  return NULL;
+}
+
 noreturn void external_command(char **argv) {
   const char *path = getenv("PATH");
 
+  /* Let 'bench' know how long it has taken to get here. */
+  stampexec();
+
   if (!index(argv[0], '/') && path) {
     /* TODO: For all paths in PATH construct an absolute path and execve it. */
 #ifdef STUDENT
 
-    size_t l;
-    while ((l = strcspn(path, ":")) >
-           0) /* do untill we don't have more paths in PATH */
-    {
-      char *candidate = strndup(
-        path,
-        l); /* copy the first potential path (it allocates memory itself) */
-      strapp(
-        &candidate,
-        "/"); /* add '/' between path and command name (allocates itself) */
-      strapp(&candidate,
-             argv[0]); /* add command name to path (allocates itself) */
-      path += (l + 1); /* move to the next candidate path */
-      (void)execve(candidate, argv, environ); /* try to execve */
-      free(candidate); /* free the allocated memory if execve fails */
-    }
+    const char *file = findcommand(argv[0]);
+    if (file)
+      (void)execve(file, argv, environ);
 
 #endif /* !STUDENT */
   } else {
@@ -0,0 +1,89 @@
+/* glibc declares CPU affinity interface only for _GNU_SOURCE, which clashes
+ * with declarations of csapp.h, hence this file does not include shell.h.
+ * Prototypes of functions defined here live there. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Parse CPU list in sysfs format (e.g. "0-3,8,10-11"). */
+static bool parsecpus(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*s && *s != '\n') {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+    if (end == s || lo < 0)
+      return false;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s || hi < lo)
+        return false;
+    }
+    if (hi >= CPU_SETSIZE)
+      return false;
+    for (long c = lo; c <= hi; c++)
+      CPU_SET(c, set);
+    s = end;
+    if (*s == ',')
+      s++;
+    else if (*s && *s != '\n')
+      return false;
+  }
+  return true;
+}
+
+/* Format CPU set as a list of ranges, inverse of `parsecpus`. */
+static void fmtcpus(cpu_set_t *set, char *buf, size_t size) {
+  size_t n = 0;
+  buf[0] = '\0';
+  for (int c = 0; c < CPU_SETSIZE && n < size; c++) {
+    if (!CPU_ISSET(c, set))
+      continue;
+    int last = c;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+      last++;
+    if (last == c)
+      n += snprintf(buf + n, size - n, "%s%d", n ? "," : "", c);
+    else
+      n += snprintf(buf + n, size - n, "%s%d-%d", n ? "," : "", c, last);
+    c = last;
+  }
+}
+
+/* Expand CPU list into numbers of at most `max` CPUs in ascending order.
+ * Returns how many there are, or -1 if the list is malformed. */
+int cpulist(const char *list, int *cpu, int max) {
+  cpu_set_t set;
+  int n = 0;
+
+  if (!parsecpus(list, &set))
+    return -1;
+  for (int c = 0; c < CPU_SETSIZE && n < max; c++)
+    if (CPU_ISSET(c, &set))
+      cpu[n++] = c;
+  return n;
+}
+
+/* Write CPUs that process `pid` is allowed to run on into `buf`. */
+bool getcpus(pid_t pid, char *buf, size_t size) {
+  cpu_set_t set;
+
+  if (sched_getaffinity(pid, sizeof(set), &set) < 0)
+    return false;
+  fmtcpus(&set, buf, size);
+  return true;
+}
+
+/* Restrict process `pid` to CPUs given as a list (e.g. "0-3,8"). */
+bool setcpus(pid_t pid, const char *list) {
+  cpu_set_t set;
+
+  if (!parsecpus(list, &set)) {
+    errno = EINVAL;
+    return false;
+  }
+  return sched_setaffinity(pid, sizeof(set), &set) == 0;
+}
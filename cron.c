@@ -0,0 +1,222 @@
+#include "shell.h"
+
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS                                                           \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE | IN_CREATE | IN_DELETE |  \
+   IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Firing that could not be handled within this time is considered late. */
+#define LATE_MS 1000
+
+typedef struct schedule {
+  int id;             /* number shown by 'jobs', 0 if the slot is free */
+  char *timing;       /* e.g. 'every 5m' or 'at 12:30', as given */
+  char *cmdline;      /* evaluated in background at each firing */
+  schedspec_t spec;
+  int timer;          /* timerfd that fires the schedule */
+  int inotify;        /* reports changes of watched files, or -1 */
+  char **paths;       /* watched files */
+  int npaths;
+  struct timespec t0; /* when an 'every' schedule has been set up */
+  uint64_t fired;     /* timer expirations so far */
+  bool due;           /* fired but not yet handled by `runschedules` */
+  int runs, skipped, missed;
+} schedule_t;
+
+static schedule_t *schedules = NULL;
+static int nschedules = 0;
+static int lastid = 0;
+
+static long elapsed(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000L +
+         (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+static void fire(int fd, void *arg) {
+  schedule_t *s = &schedules[(long)arg];
+  uint64_t n = readtimer(fd);
+
+  if (n == 0)
+    return;
+  /* Timer could have expired more than once since it's been looked at. */
+  s->missed += n - 1;
+  s->fired += n;
+  s->due = true;
+}
+
+/* (Re)register watches of all files, as a file replaced by rename is no
+ * longer watched. */
+static void watchfiles(schedule_t *s) {
+  for (int i = 0; i < s->npaths; i++)
+    if (inotify_add_watch(s->inotify, s->paths[i], WATCH_EVENTS) < 0)
+      msg("watch-files: %s: %s\n", s->paths[i], strerror(errno));
+}
+
+/* Files have changed, so the command is run after they stop changing for a
+ * while. Each change postpones it again, so bursts of changes (e.g. writing
+ * many files by a build) result in one run. */
+static void changed(int fd, void *arg) {
+  schedule_t *s = &schedules[(long)arg];
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    continue;
+  settimer(s->timer, s->spec.delay, 0);
+}
+
+/* Set up a schedule for `cmdline`, which already ends with '&' if `bg` is set.
+ * `timing` is only used for listing. */
+void addschedule(schedspec_t *spec, const char *timing, const char *cmdline,
+                 bool bg) {
+  int i;
+
+  for (i = 0; i < nschedules && schedules[i].id; i++)
+    continue;
+  if (i == nschedules)
+    schedules = realloc(schedules, sizeof(schedule_t) * ++nschedules);
+
+  schedule_t *s = &schedules[i];
+  *s = (schedule_t){.id = ++lastid, .spec = *spec, .inotify = -1};
+  s->timing = strdup(timing);
+  s->cmdline = malloc(strlen(cmdline) + 3);
+  strcpy(s->cmdline, cmdline);
+  /* Jobs of schedule never take over the terminal. */
+  if (!bg)
+    strcat(s->cmdline, " &");
+
+  if (spec->paths) {
+    /* Run the command right away, and then whenever files change. */
+    s->timer = addtimer(0, 0, fire, (void *)(long)i);
+    s->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (s->inotify < 0)
+      unix_error("inotify_init1 error");
+    s->npaths = spec->npaths;
+    s->paths = malloc(sizeof(char *) * s->npaths);
+    for (int k = 0; k < s->npaths; k++) {
+      /* Files are watched again after each run, possibly from another
+       * working directory, so relative paths would not do. */
+      char *path = realpath(spec->paths[k], NULL);
+      s->paths[k] = path ? path : strdup(spec->paths[k]);
+    }
+    s->spec.paths = NULL;
+    watchfiles(s);
+    addevent(s->inotify, changed, (void *)(long)i);
+    s->due = true;
+  } else if (spec->period > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &s->t0);
+    s->timer = addtimer(spec->period, spec->period, fire, (void *)(long)i);
+  } else {
+    s->timer = addclocktimer(&spec->when, fire, (void *)(long)i);
+  }
+  msg("{%d} %s '%s'\n", s->id, s->timing, s->cmdline);
+}
+
+static void freeschedule(schedule_t *s) {
+  deltimer(s->timer);
+  if (s->inotify >= 0) {
+    delevent(s->inotify);
+    Close(s->inotify);
+    for (int i = 0; i < s->npaths; i++)
+      free(s->paths[i]);
+    free(s->paths);
+  }
+  free(s->timing);
+  free(s->cmdline);
+  s->id = 0;
+}
+
+/* Cancel schedule `id`. Jobs it has started are left alone. */
+bool delschedule(int id) {
+  for (int i = 0; i < nschedules; i++) {
+    if (schedules[i].id == id) {
+      freeschedule(&schedules[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* How late (in milliseconds) the last firing is being handled. */
+static long lateness(schedule_t *s) {
+  struct timespec now;
+
+  if (s->inotify >= 0)
+    return 0;
+  if (s->spec.period == 0) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    return elapsed(&s->spec.when, &now);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return elapsed(&s->t0, &now) - (long)s->fired * s->spec.period;
+}
+
+/* Start jobs of schedules that have fired, unless policies say otherwise.
+ * Called by `runqueue`, so jobs are started by `eval` outside of event
+ * callbacks, just like queued ones. */
+void runschedules(void) {
+  for (int i = 0; i < nschedules; i++) {
+    schedule_t *s = &schedules[i];
+
+    if (s->id == 0 || !s->due)
+      continue;
+    s->due = false;
+
+    if (s->inotify >= 0)
+      watchfiles(s);
+
+    long late = LATE_MS;
+    if (s->spec.period > 0)
+      late = min(late, s->spec.period / 2);
+
+    int j = scheduledjob(s->id);
+    if (s->spec.skiplate && lateness(s) > late) {
+      s->skipped++;
+    } else if (j >= 0 && s->spec.overlap == OVERLAP_SKIP) {
+      s->skipped++;
+    } else {
+      if (j >= 0 && s->spec.overlap == OVERLAP_KILL)
+        (void)killjob(j, SIGTERM);
+      /* `eval` can move schedules array around. */
+      char *cmdline = strdup(s->cmdline);
+      s->runs++;
+      scheduling = s->id;
+      eval(cmdline);
+      scheduling = 0;
+      free(cmdline);
+      s = &schedules[i];
+    }
+
+    if (s->id && s->spec.period == 0 && s->inotify < 0)
+      freeschedule(s);
+  }
+}
+
+/* List schedules for 'jobs'. */
+void watchschedules(void) {
+  for (int i = 0; i < nschedules; i++) {
+    schedule_t *s = &schedules[i];
+    struct timespec now;
+    long next;
+
+    if (s->id == 0)
+      continue;
+    if (s->inotify >= 0) {
+      msg("{%d} %s '%s' on change, runs %d, skipped %d\n", s->id, s->timing,
+          s->cmdline, s->runs, s->skipped);
+      continue;
+    }
+    if (s->spec.period > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      next = (long)(s->fired + 1) * s->spec.period - elapsed(&s->t0, &now);
+    } else {
+      clock_gettime(CLOCK_REALTIME, &now);
+      next = elapsed(&now, &s->spec.when);
+    }
+    msg("{%d} %s '%s' next in %.1fs, runs %d, skipped %d", s->id, s->timing,
+        s->cmdline, max(next, 0L) / 1000.0, s->runs, s->skipped);
+    if (s->missed)
+      msg(", missed %d", s->missed);
+    msg("\n");
+  }
+}
@@ -0,0 +1,135 @@
+#include <sys/timerfd.h>
+
+#include "shell.h"
+
+#ifdef LINUX
+#include <asm/unistd.h>
+#endif
+
+/* Size of signal mask as understood by the kernel. */
+#define KSIGSETSIZE (_NSIG / 8)
+
+typedef struct event {
+  int fd;        /* -1 if slot is free */
+  evfunc_t func; /* called when file descriptor becomes readable */
+  void *arg;     /* passed to `func` */
+} event_t;
+
+static event_t *events = NULL; /* array of event sources watched by shell */
+static int neventmax = 0;      /* number of slots in events array */
+
+static event_t *findevent(int fd) {
+  for (int i = 0; i < neventmax; i++)
+    if (events[i].fd == fd)
+      return &events[i];
+  return NULL;
+}
+
+/* Register a file descriptor to be watched while the shell waits for
+ * input or for a foreground job. `func` is called when it becomes readable
+ * (or reaches end of file) and is responsible for consuming the data. */
+void addevent(int fd, evfunc_t func, void *arg) {
+  event_t *ev = findevent(-1);
+
+  if (ev == NULL) {
+    events = realloc(events, sizeof(event_t) * (neventmax + 1));
+    ev = &events[neventmax++];
+  }
+  ev->fd = fd;
+  ev->func = func;
+  ev->arg = arg;
+}
+
+/* Stop watching a file descriptor. Does not close it. */
+void delevent(int fd) {
+  event_t *ev = findevent(fd);
+  if (ev)
+    ev->fd = -1;
+}
+
+/* Arm timer to expire after `ms` milliseconds and then every `period`
+ * milliseconds, unless `period` is zero. Zero `ms` disarms the timer. */
+void settimer(int fd, long ms, long period) {
+  struct itimerspec its = {
+    .it_value = {ms / 1000, ms % 1000 * 1000000},
+    .it_interval = {period / 1000, period % 1000 * 1000000},
+  };
+  if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    unix_error("timerfd_settime error");
+}
+
+/* Create a timer driven by the event loop. Returns its file descriptor. */
+int addtimer(long ms, long period, evfunc_t func, void *arg) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    unix_error("timerfd_create error");
+  settimer(fd, ms, period);
+  addevent(fd, func, arg);
+  return fd;
+}
+
+/* Create a timer driven by the event loop, that expires once at wall clock
+ * time `when`. It expires right away if the time has already passed. */
+int addclocktimer(const struct timespec *when, evfunc_t func, void *arg) {
+  struct itimerspec its = {.it_value = *when};
+  int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    unix_error("timerfd_create error");
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    unix_error("timerfd_settime error");
+  addevent(fd, func, arg);
+  return fd;
+}
+
+/* Disarm and destroy timer created with `addtimer` or `addclocktimer`. */
+void deltimer(int fd) {
+  delevent(fd);
+  Close(fd);
+}
+
+/* Returns number of timer expirations since last call, and rearms it. */
+uint64_t readtimer(int fd) {
+  uint64_t n;
+  if (read(fd, &n, sizeof(n)) != sizeof(n))
+    return 0;
+  return n;
+}
+
+/* Wait for registered events, signals or (if `fd` is not negative) input
+ * on `fd`, whichever comes first. Signal mask is replaced by `mask` for the
+ * duration of the wait (unless it's NULL), just like `Sigsuspend` does.
+ * Callbacks of ready events are called before returning.
+ * Returns true if `fd` is ready to be read. */
+bool waitevents(int fd, const sigset_t *mask) {
+  struct pollfd pfd[neventmax + 1];
+  int n = 0;
+
+  for (int i = 0; i < neventmax; i++)
+    if (events[i].fd >= 0)
+      pfd[n++] = (struct pollfd){.fd = events[i].fd, .events = POLLIN};
+  if (fd >= 0)
+    pfd[n++] = (struct pollfd){.fd = fd, .events = POLLIN};
+
+  if (syscall(__NR_ppoll, pfd, n, NULL, mask, KSIGSETSIZE) < 0) {
+    if (errno != EINTR)
+      unix_error("ppoll error");
+    return false;
+  }
+
+  bool ready = false;
+
+  for (int i = 0; i < n; i++) {
+    if (pfd[i].revents == 0)
+      continue;
+    if (fd >= 0 && pfd[i].fd == fd) {
+      ready = true;
+      continue;
+    }
+    /* Callback could have removed this event in the meantime. */
+    event_t *ev = findevent(pfd[i].fd);
+    if (ev)
+      ev->func(ev->fd, ev->arg);
+  }
+
+  return ready;
+}
@@ -1,25 +1,208 @@
 #include "shell.h"
 
+#include <sys/resource.h>
+#ifdef LINUX
+#include <asm/unistd.h>
+#endif
+
 typedef struct proc {
-  pid_t pid;    /* process identifier */
-  int state;    /* RUNNING or STOPPED or FINISHED */
-  int exitcode; /* -1 if exit status not yet received */
+  pid_t pid;             /* process identifier */
+  int state;             /* RUNNING or STOPPED or FINISHED */
+  int exitcode;          /* -1 if exit status not yet received */
+  long cpu;              /* CPU time (in us) at last sample by 'profile',
+                          * or in total once the process has finished */
+  int peak;              /* highest CPU utilization between samples (in %) */
+  long rchar, wchar;     /* bytes read and written at last sample */
+  bool adopted;          /* orphaned descendant taken over by the shell */
+  bool signaled;         /* `exitcode` is a number of signal that killed it */
+  bool dying;            /* left unburied until 'profile' samples it ... */
+  bool sampled;          /* ... which has happened */
 } proc_t;
 
+/* Kept for each process only if the job reports it with 'time' or 'profile',
+ * as job arrays can have thousands of processes. */
+typedef struct usage {
+  struct timespec start; /* when the process has been started */
+  struct timespec end;   /* ... and when it has finished */
+  struct rusage ru;      /* resources used by finished process */
+} usage_t;
+
 typedef struct job {
   pid_t pgid;            /* 0 if slot is free */
   proc_t *proc;          /* array of processes running in as a job */
+  usage_t *usage;        /* parallel to `proc`, or NULL if not reported */
   struct termios tmodes; /* saved terminal modes */
   int nproc;             /* number of processes */
+  int nrunning;          /* processes that are running ... */
+  int nstopped;          /* ... and stopped */
   int state;             /* changes when live processes have same state */
   char *command;         /* textual representation of command line */
+  int array;             /* index of first process of job array or -1 */
+  jobopts_t opts;        /* options given by prefix commands */
+  int timer;             /* timerfd enforcing 'timeout', -1 if none */
+  bool expired;          /* time is out and the job has been signalled */
+  int sampler;           /* timerfd sampling processes for 'profile' */
+  struct timespec sample; /* when the processes were sampled last time */
+  bool killed;           /* terminated with 'kill', so the user expects it */
+  int hold;              /* reasons why the shell keeps the job stopped */
+  int cpushare;          /* CPU share (in %) allowed by 'throttle', or 0 */
+  int throttler;         /* timerfd alternating stops and continues */
+  int *after;            /* jobs that a queued job waits for */
+  int nafter;            /* ... and their number */
+  bool onsuccess;        /* start only if all of them have succeeded */
+  int requests;          /* times the job was requested with 'singleflight' */
+  capture_t *capture;    /* output kept by the shell, stays after deletion */
+  memo_t *memo;          /* output being saved for 'memo', or NULL */
+  int schedule;          /* schedule that has started the job, or 0 */
+  char *coproc;          /* name given by 'coproc' builtin, or NULL */
+  int cofd;              /* shell's end of its socket, stays after deletion */
 } job_t;
 
+#define HOLD_MEMORY 1   /* stopped by memory guard */
+#define HOLD_THROTTLE 2 /* stopped for a while to cap its CPU share */
+
 static job_t *jobs = NULL;          /* array of all jobs */
 static int njobmax = 1;             /* number of slots in jobs array */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
 
+int maxjobs = 0;             /* max. running background jobs, 0 if any */
+static int *queue = NULL;    /* queued jobs in order of submission */
+static int nqueued = 0;      /* number of jobs in the queue */
+static int reserved = -1;    /* slot for queued job that is being started */
+static int queue_timer = -1; /* rechecks admission while machine is busy */
+
+int fgsignal = 0;   /* signal that has killed or stopped last foreground job */
+int scheduling = 0; /* schedule whose job `runschedules` is starting */
+int killtimeout = 5000; /* ms before jobs get SIGKILL at shutdown, 0 - never */
+
+#define GUARD_PERIOD 1000 /* how often memory guard checks the machine (ms) */
+#define GUARD_SETTLE 10   /* checks to skip after holding a job */
+
+static int guard_timer = -1; /* runs memory guard while it has work to do */
+static int guard_settle = 0; /* pressure figures lag behind, so wait */
+
+#define THROTTLE_PERIOD 100 /* length of run and stop cycle (in ms) */
+
+jobopts_t jobopts; /* options of the job that is about to be created */
+
+/* Processes indexed by pid, so that SIGCHLD handler finds a process without
+ * scanning all jobs, as job arrays can have thousands of them. It's a hash
+ * table with linear probing, which is modified only with SIGCHLD blocked.
+ * Jobs are found by process group, as they can change slots. */
+typedef struct {
+  pid_t pid;  /* 0 if entry is free */
+  pid_t pgid; /* of the job that the process belongs to */
+  int index;  /* of the process within the job */
+} pident_t;
+
+static pident_t *pidindex = NULL;
+static unsigned pidindexsize = 0; /* power of two */
+static unsigned npidindex = 0;
+
+static unsigned pidhash(pid_t pid) {
+  return (unsigned)pid * 2654435761U & (pidindexsize - 1);
+}
+
+static void indexproc(pid_t pid, pid_t pgid, int index) {
+  if (2 * (npidindex + 1) > pidindexsize) {
+    pident_t *old = pidindex;
+    unsigned oldsize = pidindexsize;
+
+    pidindexsize = max(2 * pidindexsize, 64U);
+    pidindex = calloc(pidindexsize, sizeof(pident_t));
+    npidindex = 0;
+    for (unsigned i = 0; i < oldsize; i++)
+      if (old[i].pid)
+        indexproc(old[i].pid, old[i].pgid, old[i].index);
+    free(old);
+  }
+
+  unsigned h = pidhash(pid);
+  while (pidindex[h].pid && pidindex[h].pid != pid)
+    h = (h + 1) & (pidindexsize - 1);
+  if (pidindex[h].pid == 0)
+    npidindex++;
+  pidindex[h] = (pident_t){pid, pgid, index};
+}
+
+/* Remove process `pid` of job `pgid`, unless the pid has been reused. */
+static void unindexproc(pid_t pid, pid_t pgid) {
+  unsigned mask = pidindexsize - 1, h;
+
+  if (pidindexsize == 0)
+    return;
+  for (h = pidhash(pid); pidindex[h].pid != pid; h = (h + 1) & mask)
+    if (pidindex[h].pid == 0)
+      return;
+  if (pidindex[h].pgid != pgid)
+    return;
+
+  /* Move entries up, so that probing does not stop at the hole. */
+  for (unsigned i = (h + 1) & mask; pidindex[i].pid; i = (i + 1) & mask) {
+    unsigned home = pidhash(pidindex[i].pid);
+    if (((i - home) & mask) >= ((i - h) & mask)) {
+      pidindex[h] = pidindex[i];
+      h = i;
+    }
+  }
+  pidindex[h].pid = 0;
+  npidindex--;
+}
+
+/* Returns job of live process `pid` and its index in `*ip`, or -1. */
+static int findproc(pid_t pid, int *ip) {
+  unsigned mask = pidindexsize - 1, h;
+
+  if (pidindexsize == 0)
+    return -1;
+  for (h = pidhash(pid); pidindex[h].pid != pid; h = (h + 1) & mask)
+    if (pidindex[h].pid == 0)
+      return -1;
+
+  pident_t *e = &pidindex[h];
+  for (int j = FG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid == e->pgid && e->index < job->nproc &&
+        job->proc[e->index].pid == pid &&
+        job->proc[e->index].state != FINISHED) {
+      *ip = e->index;
+      return j;
+    }
+  }
+  return -1;
+}
+
+/* Returns a child that has exited but hasn't been buried yet (or 0 if there
+ * is none) and its resource usage. The zombie is left for `waitpid`, which
+ * is not able to report resource usage. */
+static pid_t peekzombie(struct rusage *ru) {
+  siginfo_t si;
+
+  si.si_pid = 0;
+  if (syscall(__NR_waitid, P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT, ru) < 0)
+    return -1;
+  return si.si_pid;
+}
+
+#define SAMPLE_PERIOD 100 /* how often 'profile' samples processes (in ms) */
+
+/* A process of a job started with 'profile' has exited. Its /proc entry
+ * vanishes once it's buried, so it's left a zombie until `samplejob` reads
+ * how much data it has processed. That does not happen in signal handler,
+ * the sampler is just made to fire at once. Returns true if it's left. */
+static bool holdzombie(pid_t pid) {
+  int i, j = findproc(pid, &i);
+
+  if (j < 0 || !jobs[j].opts.profile || jobs[j].proc[i].sampled)
+    return false;
+  if (!jobs[j].proc[i].dying) {
+    jobs[j].proc[i].dying = true;
+    settimer(jobs[j].sampler, 1, SAMPLE_PERIOD);
+  }
+  return true;
+}
+
 static void sigchld_handler(int sig) {
   int old_errno = errno;
   pid_t pid;
@@ -32,63 +215,72 @@ static void sigchld_handler(int sig) {
    * WNOHANG - return if no more signals
    * WUNTRACED - receive stop signals
    * WCONTINUED - receive continue signals */
-  while ((pid = waitpid(WAIT_ANY, &status, WNOHANG | WUNTRACED | WCONTINUED)) >
-         0) {
-    /* job by job */
-    for (int j = FG; j < njobmax; j++) {
-      job_t *job = &jobs[j];
-      if (job->pgid == 0) /* free slot - ignore it */
-        continue;
-
-      /* variables to check if we need to change the job's status */
-      bool changeForRunning =
-        false; /* Any running process? == status->RUNNING */
-      bool changeForStopped = false; /* Any stopped process? AND none running
-                                        processes == status->STOPPED*/
-
-      for (int i = 0; i < job->nproc; i++) /* process by process */
-      {
-        if (job->proc[i].state ==
-            FINISHED) /* we don't need to do anything with it anymore*/
-          continue;
-
-        if (job->proc[i].pid ==
-            pid) /* our process from waitpid that we need to change */
-        {
-          job->proc[i].exitcode = -1; /* forewarned is forearmed */
-
-          if (WIFEXITED(status)) /* if terminated normally */
-          {
-            job->proc[i].state = FINISHED;
-            job->proc[i].exitcode = WEXITSTATUS(status);
-          } else if (WIFSIGNALED(status)) /* if killed by signal */
-          {
-            job->proc[i].state = FINISHED;
-            job->proc[i].exitcode = WTERMSIG(status);
-          } else if (WIFSTOPPED(status)) /* if stopped */
-          {
-            job->proc[i].state = STOPPED;
-          } else if (WIFCONTINUED(status)) /* if continued */
-          {
-            job->proc[i].state = RUNNING;
-          }
-        }
+  for (;;) {
+    struct rusage ru;
+    pid_t zombie = peekzombie(&ru);
+
+    /* Other children wait too, since `waitid` would find this one first. */
+    if (zombie > 0 && holdzombie(zombie))
+      break;
+    pid = waitpid(zombie > 0 ? zombie : WAIT_ANY, &status,
+                  WNOHANG | WUNTRACED | WCONTINUED);
+    if (pid <= 0)
+      break;
+
+    int i, j = findproc(pid, &i);
+    if (j < 0) /* not a process of any job */
+      continue;
 
-        if (job->proc[i].state == RUNNING)
-          changeForRunning = true;
-        else if (job->proc[i].state == STOPPED)
-          changeForStopped = true;
+    job_t *job = &jobs[j];
+    proc_t *proc = &job->proc[i];
+    int old = proc->state;
+
+    proc->exitcode = -1; /* forewarned is forearmed */
+
+    if (pid == zombie) {
+      struct timeval cpu;
+      timeradd(&ru.ru_utime, &ru.ru_stime, &cpu);
+      proc->cpu = cpu.tv_sec * 1000000L + cpu.tv_usec;
+      if (job->usage) {
+        job->usage[i].ru = ru;
+        clock_gettime(CLOCK_MONOTONIC, &job->usage[i].end);
       }
+    }
 
-      if (changeForRunning) /* we have at least one running process in job */
-        job->state = RUNNING;
-      else if (changeForStopped) /* we don't have any running process in job,
-                                    but at least one is stopped */
-        job->state = STOPPED;
-      else /* we don't have any running or stopped process == all are finished
-            */
-        job->state = FINISHED;
+    if (WIFEXITED(status)) /* if terminated normally */
+    {
+      proc->state = FINISHED;
+      proc->exitcode = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) /* if killed by signal */
+    {
+      proc->state = FINISHED;
+      proc->exitcode = WTERMSIG(status);
+      proc->signaled = true;
+    } else if (WIFSTOPPED(status)) /* if stopped */
+    {
+      proc->state = STOPPED;
+    } else if (WIFCONTINUED(status)) /* if continued */
+    {
+      proc->state = RUNNING;
     }
+
+    /* Keep count of processes in each state, rather than looking at all of
+     * them, so that reaping a job array does not take quadratic time. */
+    job->nrunning += (proc->state == RUNNING) - (old == RUNNING);
+    job->nstopped += (proc->state == STOPPED) - (old == STOPPED);
+
+    if (job->nrunning > 0) /* we have at least one running process in job */
+      job->state = RUNNING;
+    else if (job->nstopped > 0) /* we don't have any running process in job,
+                                   but at least one is stopped */
+      job->state = STOPPED;
+    else /* we don't have any running or stopped process == all are finished
+          */
+      job->state = FINISHED;
+
+    /* Job stopped by the shell itself has not been suspended by user. */
+    if (job->state == STOPPED && job->hold)
+      job->state = RUNNING;
   }
 
   (void)status;
@@ -97,15 +289,46 @@ static void sigchld_handler(int sig) {
   errno = old_errno;
 }
 
-/* When pipeline is done, its exitcode is fetched from the last process. */
+/* When pipeline is done, its exitcode is fetched from the last process.
+ * Job array fails if any of its processes failed. */
 static int exitcode(job_t *job) {
-  return job->proc[job->nproc - 1].exitcode;
+  int last = job->nproc - 1;
+
+  /* Adopted orphans do not decide about exit code of a job. */
+  while (last > 0 && job->proc[last].adopted)
+    last--;
+  int code = job->proc[last].exitcode;
+
+  /* A signal counts as 128 plus its number, like in the exit code of a shell,
+   * since signal numbers can be lower than exit codes. */
+  if (job->array >= 0) {
+    code = 0;
+    for (int i = 0; i < job->nproc; i++) {
+      proc_t *proc = &job->proc[i];
+      if (!proc->adopted)
+        code = max(code, proc->exitcode + (proc->signaled ? 128 : 0));
+    }
+  }
+  return code;
+}
+
+/* Returns signal that has killed any process of the job (but adopted
+ * orphans), or 0 if all of them have exited. */
+static int termsignal(job_t *job) {
+  for (int i = 0; i < job->nproc; i++)
+    if (job->proc[i].signaled && !job->proc[i].adopted)
+      return job->proc[i].exitcode;
+  return 0;
 }
 
 static int allocjob(void) {
+  /* Use the slot of queued job that is just being started. */
+  if (reserved >= 0)
+    return reserved;
+
   /* Find empty slot for background job. */
   for (int j = BG; j < njobmax; j++)
-    if (jobs[j].pgid == 0)
+    if (jobs[j].pgid == 0 && jobs[j].state != QUEUED)
       return j;
 
   /* If none found, allocate new one. */
@@ -116,10 +339,320 @@ static int allocjob(void) {
 
 static int allocproc(int j) {
   job_t *job = &jobs[j];
-  job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+  /* Grow geometrically, since job arrays can have thousands of processes. */
+  if (powerof2(job->nproc)) {
+    int n = max(1, 2 * job->nproc);
+    job->proc = realloc(job->proc, sizeof(proc_t) * n);
+    if (job->opts.time || job->opts.profile)
+      job->usage = realloc(job->usage, sizeof(usage_t) * n);
+  }
   return job->nproc++;
 }
 
+/* Called when a job started with 'timeout' runs out of time. The job is
+ * found by its timer, as it could have been moved to another slot. Timer is
+ * rearmed once if the job is to be killed after a grace period. */
+static void expirejob(int fd, void *arg) {
+  pid_t pgid = (long)arg;
+
+  (void)readtimer(fd);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = FG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid != pgid || job->timer != fd)
+      continue;
+
+    /* Processes that have already exited make kill fail, ignore that. */
+    if (job->expired) {
+      (void)kill(-pgid, SIGKILL);
+    } else if (job->state != FINISHED) {
+      msg("[%d] timed out '%s'\n", j, job->command);
+      (void)kill(-pgid, job->opts.signal);
+      if (job->state == STOPPED || job->hold)
+        (void)kill(-pgid, SIGCONT);
+      job->expired = true;
+      if (job->opts.killafter > 0) {
+        settimer(fd, job->opts.killafter, 0);
+        break;
+      }
+    }
+    deltimer(fd);
+    job->timer = -1;
+    break;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Called periodically for a job started with 'profile'. Records CPU time
+ * and I/O of its processes, which cannot be read after they have died.
+ * Processes left unburied by `holdzombie` get buried afterwards. */
+static void samplejob(int fd, void *arg) {
+  pid_t pgid = (long)arg;
+  struct timespec now;
+  bool bury = false;
+
+  (void)readtimer(fd);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = FG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid != pgid || job->sampler != fd)
+      continue;
+
+    double interval = elapsed(&job->sample, &now);
+    job->sample = now;
+
+    for (int i = 0; i < job->nproc; i++) {
+      proc_t *proc = &job->proc[i];
+      if (proc->state == FINISHED)
+        continue;
+      if (proc->dying)
+        proc->sampled = bury = true;
+      long cpu = proccpu(proc->pid);
+      if (cpu < 0)
+        continue;
+      if (interval > 0)
+        proc->peak = max(proc->peak, (cpu - proc->cpu) / (interval * 1e4));
+      proc->cpu = cpu;
+      (void)procio(proc->pid, &proc->rchar, &proc->wchar);
+    }
+    break;
+  }
+
+  if (bury)
+    sigchld_handler(SIGCHLD);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+int singleflight = 0; /* do not start background jobs that are running */
+
+/* Attach request for a background job to an identical one (see `identity`
+ * in shell.c) that is running or queued, if there's any. The job reports
+ * its completion once for all requests. Returns true if it has been found. */
+bool joinjob(uint32_t identity, const char *key) {
+  for (int j = BG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->opts.identity != identity ||
+        (job->pgid == 0 && job->state != QUEUED) || job->state == FINISHED ||
+        job->opts.identkey == NULL || strcmp(job->opts.identkey, key))
+      continue;
+    job->requests++;
+    msg("[%d] joined '%s'\n", j, job->command);
+    return true;
+  }
+  return false;
+}
+
+/* Number of background jobs that are running right now. */
+static int runningjobs(void) {
+  int n = 0;
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state == RUNNING)
+      n++;
+  return n;
+}
+
+/* Stop a background job on behalf of the shell. It's still reported as
+ * running, as the user has not suspended it. */
+static void holdjob(int j, int reason) {
+  job_t *job = &jobs[j];
+
+  if (job->hold == 0)
+    (void)kill(-job->pgid, SIGSTOP);
+  job->hold |= reason;
+}
+
+/* Continue a job once no reason to hold it is left. */
+static void releasejob(int j, int reason) {
+  job_t *job = &jobs[j];
+
+  job->hold &= ~reason;
+  if (job->hold == 0)
+    (void)kill(-job->pgid, SIGCONT);
+}
+
+/* Resident set size of all processes of a job in KiB. */
+static long jobrss(job_t *job) {
+  long rss = 0;
+
+  for (int i = 0; i < job->nproc; i++) {
+    procstat_t st;
+    int fd;
+    if (job->proc[i].state == FINISHED ||
+        (fd = openproc(job->proc[i].pid, "stat")) < 0)
+      continue;
+    if (readstat(fd, &st))
+      rss += st.rss;
+    close(fd);
+  }
+  return rss;
+}
+
+/* Find the largest (or smallest) background job that is running (or held
+ * by memory guard). Returns -1 if there's none. */
+static int memoryhog(bool held, bool largest) {
+  int found = -1;
+  long found_rss = 0;
+
+  for (int j = BG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid == 0 || job->state != RUNNING ||
+        (bool)(job->hold & HOLD_MEMORY) != held)
+      continue;
+    long rss = jobrss(job);
+    if (found < 0 || (largest ? rss > found_rss : rss < found_rss)) {
+      found = j;
+      found_rss = rss;
+    }
+  }
+  return found;
+}
+
+/* Called periodically while there are background jobs and 'memguard' or
+ * 'minfree' is set. Holds the largest job when memory gets scarce and
+ * releases the smallest held one when the shortage is over, one at a time.
+ * Held jobs are released gradually if the guard gets turned off. */
+static void guardmemory(int fd, void *arg) {
+  (void)readtimer(fd);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  bool enabled = memguard > 0 || minfree > 0;
+  int verdict = enabled ? memverdict() : -1;
+  int j;
+
+  if (guard_settle > 0)
+    guard_settle--;
+
+  if (verdict > 0 && guard_settle == 0 && (j = memoryhog(false, true)) >= 0) {
+    holdjob(j, HOLD_MEMORY);
+    msg("[%d] held '%s' due to memory shortage\n", j, jobs[j].command);
+    guard_settle = GUARD_SETTLE;
+  } else if (verdict < 0 && (j = memoryhog(true, false)) >= 0) {
+    releasejob(j, HOLD_MEMORY);
+    msg("[%d] released '%s'\n", j, jobs[j].command);
+  }
+
+  if (memoryhog(true, false) < 0 && (!enabled || runningjobs() == 0)) {
+    deltimer(guard_timer);
+    guard_timer = -1;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Start memory guard if it is enabled and has jobs to look after, e.g. once
+ * 'memguard' or 'minfree' gets set while background jobs are running. */
+static void startguard(void) {
+  if ((memguard > 0 || minfree > 0) && guard_timer < 0 && runningjobs() > 0)
+    guard_timer = addtimer(GUARD_PERIOD, GUARD_PERIOD, guardmemory, NULL);
+}
+
+int subreaper = 0;      /* adopt orphaned descendants of jobs */
+static int reaping = 0; /* whether the kernel has been asked to do so */
+
+/* With 'subreaper' on, orphaned descendants of jobs are reparented to the
+ * shell instead of init, so they are buried as soon as they exit. */
+static void setsubreaper(void) {
+  if (!!subreaper != reaping) {
+    Prctl(PR_SET_CHILD_SUBREAPER, !!subreaper);
+    reaping = !!subreaper;
+  }
+}
+
+static void unthrottle(int j) {
+  job_t *job = &jobs[j];
+
+  if (job->throttler >= 0)
+    deltimer(job->throttler);
+  job->throttler = -1;
+  job->cpushare = 0;
+  if (job->hold & HOLD_THROTTLE)
+    releasejob(j, HOLD_THROTTLE);
+}
+
+/* Switch a throttled job between running and stopped part of the cycle.
+ * The job is found by its timer, as it could have been moved. */
+static void throttletick(int fd, void *arg) {
+  pid_t pgid = (long)arg;
+
+  (void)readtimer(fd);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = FG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->pgid != pgid || job->throttler != fd)
+      continue;
+
+    /* Suspended by the user (e.g. with 'kill -STOP'), so it must not be
+     * continued at the end of the cycle. */
+    if (job->state == STOPPED) {
+      unthrottle(j);
+      break;
+    }
+
+    if (job->hold & HOLD_THROTTLE) {
+      releasejob(j, HOLD_THROTTLE);
+      settimer(fd, THROTTLE_PERIOD * job->cpushare / 100, 0);
+    } else {
+      holdjob(j, HOLD_THROTTLE);
+      settimer(fd, THROTTLE_PERIOD * (100 - job->cpushare) / 100, 0);
+    }
+    break;
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Cap CPU share of a background job to `share` percent without help of
+ * cgroups, by stopping and continuing it within each THROTTLE_PERIOD.
+ * Zero or 100 lifts the cap, negative `share` leaves it as is. A job
+ * suspended by the user is not capped, as that would continue it.
+ * Returns previous share (0 if none) or -1 if there's no such job. */
+int throttlejob(int j, int share) {
+  if (j < BG || j >= njobmax || jobs[j].pgid == 0 ||
+      jobs[j].state == FINISHED)
+    return -1;
+
+  job_t *job = &jobs[j];
+  int old = job->cpushare;
+
+  if (share == 0 || share >= 100) {
+    unthrottle(j);
+  } else if (share > 0 && job->state != STOPPED) {
+    job->cpushare = share;
+    if (job->throttler < 0)
+      job->throttler =
+        addtimer(THROTTLE_PERIOD * share / 100, 0, throttletick,
+                 (void *)(long)job->pgid);
+  }
+  return old;
+}
+
+/* Close the socket of a coprocess, which is kept after the job has been
+ * deleted, until the slot gets reused. */
+static void dropcoproc(job_t *job) {
+  if (job->coproc == NULL)
+    return;
+  Close(job->cofd);
+  free(job->coproc);
+  job->coproc = NULL;
+}
+
 int addjob(pid_t pgid, int bg) {
   int j = bg ? allocjob() : FG;
   job_t *job = &jobs[j];
@@ -128,35 +661,99 @@ int addjob(pid_t pgid, int bg) {
   job->state = RUNNING;
   job->command = NULL;
   job->proc = NULL;
+  job->usage = NULL;
   job->nproc = 0;
+  job->nrunning = job->nstopped = 0;
   job->tmodes = shell_tmodes;
+  job->array = -1;
+  job->opts = jobopts;
+  if (jobopts.identkey)
+    job->opts.identkey = strdup(jobopts.identkey);
+  job->timer = -1;
+  job->expired = false;
+  job->killed = false;
+  job->hold = 0;
+  job->cpushare = 0;
+  job->throttler = -1;
+  job->requests = 1;
+  job->schedule = scheduling;
+  dropcoproc(job); /* of the job that used the slot before */
+  freecapture(job->capture); /* of the job that used the slot before */
+  job->capture = bg ? takecapture() : NULL;
+  job->memo = bg ? NULL : takememo();
+  setsubreaper(); /* before any process of the job can be orphaned */
+  if (bg)
+    startguard();
+  if (jobopts.timeout > 0)
+    job->timer = addtimer(jobopts.timeout, 0, expirejob, (void *)(long)pgid);
+  job->sampler = -1;
+  if (jobopts.profile) {
+    job->sampler = addtimer(SAMPLE_PERIOD, SAMPLE_PERIOD, samplejob,
+                            (void *)(long)pgid);
+    clock_gettime(CLOCK_MONOTONIC, &job->sample);
+  }
   return j;
 }
 
+/* Turn a job into a job array, whose processes are numbered from `first`. */
+void arrayjob(int j, int first) {
+  assert(j < njobmax);
+  jobs[j].array = first;
+}
+
 static void deljob(job_t *job) {
   assert(job->state == FINISHED);
+  if (job->timer >= 0)
+    deltimer(job->timer);
+  if (job->sampler >= 0)
+    deltimer(job->sampler);
+  if (job->throttler >= 0)
+    deltimer(job->throttler);
+  job->timer = job->sampler = job->throttler = -1;
+  for (int i = 0; i < job->nproc; i++)
+    unindexproc(job->proc[i].pid, job->pgid);
   free(job->command);
   free(job->proc);
+  free(job->usage);
+  free(job->opts.identkey);
+  job->opts.identkey = NULL;
   job->pgid = 0;
   job->command = NULL;
   job->proc = NULL;
+  job->usage = NULL;
   job->nproc = 0;
 }
 
 static void movejob(int from, int to) {
   assert(jobs[to].pgid == 0);
+  freecapture(jobs[to].capture);
+  dropcoproc(&jobs[to]);
   memcpy(&jobs[to], &jobs[from], sizeof(job_t));
   memset(&jobs[from], 0, sizeof(job_t));
 }
 
+/* Builds the string in one go, as `argv` can hold thousands of arguments. */
 static void mkcommand(char **cmdp, char **argv) {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+  size_t len = *cmdp ? strlen(*cmdp) + 3 : 0;
+  for (char **p = argv; *p; p++)
+    len += strlen(*p) + 1;
+
+  char *cmd = *cmdp ? realloc(*cmdp, len) : malloc(len);
+  char *end = *cmdp ? stpcpy(cmd + strlen(cmd), " | ") : cmd;
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+  for (end = stpcpy(end, *argv++); *argv; argv++) {
+    *end++ = ' ';
+    end = stpcpy(end, *argv);
   }
+  *cmdp = cmd;
+}
+
+/* Time the shell is about to fork a process of a job. Taken before `fork`,
+ * as the child may run for a while before the parent gets to `addproc`. */
+static struct timespec forktime;
+
+void markfork(void) {
+  clock_gettime(CLOCK_MONOTONIC, &forktime);
 }
 
 void addproc(int j, pid_t pid, char **argv) {
@@ -169,12 +766,176 @@ void addproc(int j, pid_t pid, char **argv) {
   proc->pid = pid;
   proc->state = RUNNING;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  if (job->usage) {
+    usage_t *usage = &job->usage[p];
+    /* Adopted processes have not been forked by the shell. */
+    if (forktime.tv_sec != 0)
+      usage->start = forktime;
+    else
+      clock_gettime(CLOCK_MONOTONIC, &usage->start);
+    usage->end = usage->start;
+    memset(&usage->ru, 0, sizeof(usage->ru));
+  }
+  proc->cpu = proc->rchar = proc->wchar = 0;
+  proc->peak = 0;
+  proc->adopted = false;
+  proc->signaled = false;
+  proc->dying = proc->sampled = false;
+  forktime = (struct timespec){0};
+  job->nrunning++;
+  indexproc(pid, job->pgid, p);
+  /* Elements of job array share the command. */
+  if (argv)
+    mkcommand(&job->command, argv);
+}
+
+static double seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void showusage(const char *who, double real, struct rusage *ru) {
+  msg("%8s %8.3fs %8.3fs %8.3fs %8ldK %7ld %7ld\n", who, real,
+      seconds(ru->ru_utime), seconds(ru->ru_stime), ru->ru_maxrss,
+      ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/* Report resources used by each process of a job started with 'time' and
+ * by the whole job. Maximum RSS of the job is the largest one of its
+ * processes. Processes of job arrays are not listed one by one. */
+static void reportusage(job_t *job) {
+  struct timespec start = job->usage[0].start, end = job->usage[0].end;
+  struct rusage total = {};
+  char pid[16];
+
+  msg("%8s %9s %9s %9s %9s %7s %7s\n", "PID", "REAL", "USER", "SYS",
+      "MAXRSS", "VCSW", "IVCSW");
+
+  for (int i = 0; i < job->nproc; i++) {
+    usage_t *usage = &job->usage[i];
+    struct rusage *ru = &usage->ru;
+
+    if (job->array < 0) {
+      snprintf(pid, sizeof(pid), "%d", job->proc[i].pid);
+      showusage(pid, elapsed(&usage->start, &usage->end), ru);
+    }
+
+    if (elapsed(&usage->start, &start) > 0)
+      start = usage->start;
+    if (elapsed(&end, &usage->end) > 0)
+      end = usage->end;
+    timeradd(&total.ru_utime, &ru->ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &ru->ru_stime, &total.ru_stime);
+    total.ru_maxrss = max(total.ru_maxrss, ru->ru_maxrss);
+    total.ru_nvcsw += ru->ru_nvcsw;
+    total.ru_nivcsw += ru->ru_nivcsw;
+  }
+
+  if (job->nproc > 1)
+    showusage("total", elapsed(&start, &end), &total);
+}
+
+/* Report how busy was each stage of a pipeline started with 'profile'.
+ * The stage that kept its CPU busy for the largest part of the time is
+ * likely to be the bottleneck, as other stages wait for it on pipes. */
+static void reportprofile(job_t *job) {
+  char *stages = strdup(job->command), *stage = stages;
+  char rbuf[16], wbuf[16], tbuf[16];
+  int bottleneck = 0;
+  double maxutil = -1;
+
+  msg("%5s %8s %8s %5s %5s %8s %8s %10s  %s\n", "STAGE", "PID", "CPU",
+      "UTIL", "PEAK", "READ", "WRITE", "OUTPUT", "COMMAND");
+
+  for (int i = 0; i < job->nproc; i++) {
+    proc_t *proc = &job->proc[i];
+    double real = elapsed(&job->usage[i].start, &job->usage[i].end);
+    double cpu = proc->cpu / 1e6;
+    double util = real > 0 ? 100 * cpu / real : 0;
+
+    if (proc->adopted)
+      continue;
+
+    if (util > maxutil) {
+      maxutil = util;
+      bottleneck = i;
+    }
+
+    /* Stages of the command are separated by " | ". */
+    char *next = job->array < 0 ? strstr(stage, " | ") : NULL;
+    if (next)
+      *next = '\0';
+
+    msg("%5d %8d %7.2fs %4.0f%% %4d%% %8s %8s %8s/s  %s\n", i + 1, proc->pid,
+        cpu, util, proc->peak, fmtbytes(proc->rchar, rbuf, sizeof(rbuf)),
+        fmtbytes(proc->wchar, wbuf, sizeof(wbuf)),
+        fmtbytes(real > 0 ? proc->wchar / real : 0, tbuf, sizeof(tbuf)),
+        stage);
+
+    if (next)
+      stage = next + 3;
+  }
+
+  if (job->nproc > 1)
+    msg("bottleneck: stage %d (%d) with %.0f%% CPU utilization\n",
+        bottleneck + 1, job->proc[bottleneck].pid, maxutil);
+  free(stages);
+}
+
+/* Remove a job from the queue and free its slot. */
+static void unqueuejob(int j) {
+  job_t *job = &jobs[j];
+
+  for (int i = 0; i < nqueued; i++) {
+    if (queue[i] == j) {
+      memmove(&queue[i], &queue[i + 1], sizeof(int) * (nqueued - i - 1));
+      nqueued--;
+      break;
+    }
+  }
+
+  free(job->command);
+  free(job->after);
+  free(job->opts.identkey);
+  job->opts.identkey = NULL;
+  job->command = NULL;
+  job->after = NULL;
+  job->nafter = 0;
+  job->state = FINISHED;
+}
+
+/* Tell queued jobs waiting for job `d` that it's gone with `status`, which
+ * is -1 if it has been cancelled. Cancellation cascades down the chain. */
+static void resolvejob(int d, int status) {
+  for (int i = 0; i < nqueued; i++) {
+    job_t *job = &jobs[queue[i]];
+    bool failed = false;
+
+    for (int k = 0; k < job->nafter; k++) {
+      if (job->after[k] != d)
+        continue;
+      job->after[k--] = job->after[--job->nafter];
+      failed = job->onsuccess && status != 0;
+    }
+    if (!failed)
+      continue;
+
+    int j = queue[i];
+    msg("[%d] cancelled '%s'\n", j, job->command);
+    unqueuejob(j);
+    resolvejob(j, -1);
+    i = -1; /* queue has changed */
+  }
+}
+
+/* Returns job's state without deleting the job if it has finished. */
+int peekjobstate(int j) {
+  assert(j < njobmax);
+  return jobs[j].state;
 }
 
 /* Returns job's state.
  * If it's finished, delete it and return exitcode through statusp. */
-static int jobstate(int j, int *statusp) {
+int jobstate(int j, int *statusp) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
   int state = job->state;
@@ -183,7 +944,16 @@ static int jobstate(int j, int *statusp) {
 #ifdef STUDENT
 
   if (state == FINISHED) {
+    if (job->opts.time)
+      reportusage(job);
+    if (job->opts.profile)
+      reportprofile(job);
     *statusp = exitcode(job); /* get the job's status */
+    finishmemo(job->memo, *statusp, termsignal(job) != 0);
+    if (j == FG)
+      fgsignal = termsignal(job);
+    job->memo = NULL;
+    resolvejob(j, *statusp);  /* let dependent jobs know */
     deljob(job);              /* clean up the job */
   }
 
@@ -193,21 +963,281 @@ static int jobstate(int j, int *statusp) {
   return state;
 }
 
+/* Make job `j` a coprocess called `name`, which the shell talks to through
+ * socket `fd`. A coprocess that has finished is forgotten when another one
+ * takes its name. */
+void setcoproc(int j, const char *name, int fd) {
+  assert(j >= BG && j < njobmax);
+  for (int k = BG; k < njobmax; k++)
+    if (jobs[k].coproc && !strcmp(jobs[k].coproc, name))
+      dropcoproc(&jobs[k]);
+  jobs[j].coproc = strdup(name);
+  jobs[j].cofd = fd;
+}
+
+/* Returns the shell's socket of coprocess `name`, or -1 if there's none.
+ * Unless `live` is set, the socket of a finished coprocess is returned too,
+ * as it can still hold unread output. */
+int coprocfd(const char *name, bool live) {
+  for (int j = BG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->coproc && !strcmp(job->coproc, name) && (job->pgid || !live))
+      return job->cofd;
+  }
+  return -1;
+}
+
+/* Returns number of a job started by schedule `id` that is still running,
+ * stopped or queued, or -1 if there's none. */
+int scheduledjob(int id) {
+  for (int j = BG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (job->schedule == id &&
+        ((job->pgid && job->state != FINISHED) || job->state == QUEUED))
+      return j;
+  }
+  return -1;
+}
+
+/* Output captured for a job, which is kept until its slot gets reused. */
+capture_t *jobcapture(int j) {
+  return j >= 0 && j < njobmax ? jobs[j].capture : NULL;
+}
+
 char *jobcmd(int j) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
   return job->command;
 }
 
+/* Call `func` for each process of a job that has not finished yet. */
+bool foreachproc(int j, void (*func)(pid_t pid, void *arg), void *arg) {
+  if (j < 0 || j >= njobmax || jobs[j].pgid == 0)
+    return false;
+
+  job_t *job = &jobs[j];
+  for (int i = 0; i < job->nproc; i++)
+    if (job->proc[i].state != FINISHED)
+      func(job->proc[i].pid, arg);
+  return true;
+}
+
+static void recheckqueue(int fd, void *arg) {
+  (void)readtimer(fd);
+  runqueue();
+}
+
+static bool canstart(void) {
+  if (maxjobs > 0 && runningjobs() >= maxjobs)
+    return false;
+  if (overloaded()) {
+    /* Nobody will tell us when the load drops, so check periodically. */
+    if (queue_timer < 0)
+      queue_timer = addtimer(1000, 1000, recheckqueue, NULL);
+    return false;
+  }
+  return true;
+}
+
+/* Position in the queue of the first job that does not wait for others. */
+static int nextready(void) {
+  for (int i = 0; i < nqueued; i++)
+    if (jobs[queue[i]].nafter == 0)
+      return i;
+  return -1;
+}
+
+/* Returns true if a new background job can be started right away.
+ * Jobs that have been queued earlier take precedence. */
+bool admitjob(void) {
+  if (reserved >= 0)
+    return true;
+  return nextready() < 0 && canstart();
+}
+
+/* Put a background job into the queue. It's started by `runqueue` when
+ * number of running jobs drops below 'maxjobs' and machine is not busy.
+ * Returns job number. */
+int queuejob(const char *cmdline) {
+  int j = allocjob();
+  job_t *job = &jobs[j];
+
+  job->state = QUEUED;
+  job->command = strdup(cmdline);
+  job->opts = jobopts;
+  if (jobopts.identkey)
+    job->opts.identkey = strdup(jobopts.identkey);
+  job->requests = 1;
+  job->schedule = scheduling;
+  queue = realloc(queue, sizeof(int) * (nqueued + 1));
+  queue[nqueued++] = j;
+  msg("[%d] queued '%s'\n", j, job->command);
+  return j;
+}
+
+/* Put a background job into the queue, so that it's started when all jobs
+ * listed in `after` have finished, or cancelled if any of them fails and
+ * `onsuccess` is set. Returns job number or -1 if there's no such job. */
+int afterjob(const char *cmdline, int *after, int nafter, bool onsuccess) {
+  for (int i = 0; i < nafter; i++) {
+    int d = after[i];
+    if (d < BG || d >= njobmax ||
+        (jobs[d].pgid == 0 && jobs[d].state != QUEUED)) {
+      msg("ERROR: No such job: %%%d\n", d);
+      return -1;
+    }
+  }
+
+  int j = queuejob(cmdline);
+  job_t *job = &jobs[j];
+
+  job->after = malloc(sizeof(int) * nafter);
+  memcpy(job->after, after, sizeof(int) * nafter);
+  job->nafter = nafter;
+  job->onsuccess = onsuccess;
+  return j;
+}
+
+static int pidcmp(const void *a, const void *b) {
+  pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Take over a process that has been reparented to the shell. It joins the
+ * background job of its process group or becomes a new one. Orphans of the
+ * foreground job (e.g. 'sh -c "cmd &"') never join it, as the user would
+ * have to wait for them. */
+static void adopt(pid_t pid) {
+  char buf[4096], *argv[64];
+  int argc = 0, j;
+
+  pid_t pgid = getpgid(pid);
+  if (pgid < 0)
+    return;
+
+  int fd = openproc(pid, "cmdline");
+  ssize_t n = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+  if (fd >= 0)
+    close(fd);
+  if (n <= 0)
+    n = snprintf(buf, sizeof(buf), "%d", pid) + 1;
+  buf[n] = '\0';
+  for (char *s = buf; s < buf + n && *s && argc < 63; s += strlen(s) + 1)
+    argv[argc++] = s;
+  argv[argc] = NULL;
+
+  for (j = BG; j < njobmax; j++)
+    if (jobs[j].pgid == pgid)
+      break;
+
+  if (j == njobmax) {
+    j = addjob(pgid, BG);
+    addproc(j, pid, argv);
+  } else {
+    addproc(j, pid, NULL);
+    jobs[j].state = RUNNING;
+  }
+  jobs[j].proc[jobs[j].nproc - 1].adopted = true;
+  msg("[%d] adopted %d '%s'\n", j, pid, jobs[j].command);
+}
+
+/* Adopt children of the shell that are not known as processes of any job,
+ * i.e. orphans reparented to the shell. */
+static void adoptorphans(void) {
+  setsubreaper();
+  if (!reaping)
+    return;
+
+  /* Processes of jobs in order, so that newcomers are found quickly. */
+  int nknown = 0;
+  for (int j = FG; j < njobmax; j++)
+    nknown += jobs[j].pgid ? jobs[j].nproc : 0;
+  pid_t *known = malloc(sizeof(pid_t) * (nknown + 1));
+  nknown = 0;
+  for (int j = FG; j < njobmax; j++)
+    for (int i = 0; jobs[j].pgid && i < jobs[j].nproc; i++)
+      known[nknown++] = jobs[j].proc[i].pid;
+  qsort(known, nknown, sizeof(pid_t), pidcmp);
+
+  /* Leave room for some orphans besides processes of jobs. */
+  size_t size = (nknown + 1024) * 12;
+  char path[64], *buf = malloc(size);
+  snprintf(path, sizeof(path), "/proc/self/task/%d/children", getpid());
+
+  if (readfile(path, buf, size)) {
+    char *s = buf, *end;
+    for (pid_t pid; (pid = strtol(s, &end, 10)) > 0; s = end)
+      if (*end == ' ' && !bsearch(&pid, known, nknown, sizeof(pid_t), pidcmp))
+        adopt(pid);
+  }
+
+  free(buf);
+  free(known);
+}
+
+/* Start queued jobs if there's room for them. Called whenever the shell
+ * wakes up, which happens after each SIGCHLD, so that jobs are started as
+ * soon as running ones have finished. */
+void runqueue(void) {
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  /* Jobs started here are not part of a command line measured by 'bench',
+   * so they must not leave their launch time for it. */
+  long *launch = launchtime;
+  launchtime = NULL;
+
+  /* Good time to look for orphans and start scheduled jobs too. */
+  adoptorphans();
+  runschedules();
+  startguard();
+
+  /* Jobs waiting for finished ones need not wait until they get reported. */
+  for (int d = BG; d < njobmax && nqueued > 0; d++)
+    if (jobs[d].pgid != 0 && jobs[d].state == FINISHED)
+      resolvejob(d, exitcode(&jobs[d]));
+
+  for (int i; (i = nextready()) >= 0 && canstart();) {
+    int j = queue[i];
+    char *cmdline = jobs[j].command;
+    int requests = jobs[j].requests;
+    int schedule = jobs[j].schedule;
+
+    jobs[j].command = NULL;
+    unqueuejob(j);
+
+    /* `eval` starts the job in the same slot. */
+    reserved = j;
+    eval(cmdline);
+    reserved = -1;
+    free(cmdline);
+
+    if (jobs[j].pgid != 0) {
+      jobs[j].requests = requests;
+      jobs[j].schedule = schedule;
+    }
+  }
+
+  if (queue_timer >= 0 && (nextready() < 0 || !overloaded())) {
+    deltimer(queue_timer);
+    queue_timer = -1;
+  }
+
+  launchtime = launch;
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
 bool resumejob(int j, int bg, sigset_t *mask) {
   if (j < 0) {
-    for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--)
+    for (j = njobmax - 1; j > 0 && (jobs[j].state == FINISHED ||
+                                    jobs[j].state == QUEUED);
+         j--)
       continue;
   }
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j >= njobmax || jobs[j].state == FINISHED || jobs[j].state == QUEUED)
     return false;
 
     /* TODO: Continue stopped job. Possibly move job to foreground slot. */
@@ -215,6 +1245,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
   job_t *job = &jobs[j];
   job->state = RUNNING;
+  job->hold = 0; /* user knows better than memory guard */
 
   /* Explanation:
    * negative pgid sends signal to all processes in group
@@ -222,6 +1253,14 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
   /* foreground job */
   if (!bg) {
+    unthrottle(j); /* the user waits for it now */
+    if (autonice) {
+      int error = 0;
+      (void)foreachproc(j, promoteproc, &error);
+      if (error)
+        msg("[%d] priority not restored: %s\n", j, strerror(error));
+    }
+
     movejob(j, 0);
 
     /* set as foreground process group (for example for cat - it would stop
@@ -229,11 +1268,20 @@ bool resumejob(int j, int bg, sigset_t *mask) {
     setfgpgrp(jobs[0].pgid);
     Tcsetattr(tty_fd, 0, &shell_tmodes);
 
+    /* What the job has said so far comes first, then it speaks directly. */
+    if (jobs[0].capture) {
+      showcapture(jobs[0].capture);
+      echocapture(jobs[0].capture, true);
+    }
+
     Kill(-jobs[0].pgid, SIGCONT);
 
     msg("[%d] continue '%s'\n", j, jobcmd(0));
     (void)monitorjob(mask);
   } else {
+    if (autonice)
+      (void)foreachproc(j, demoteproc, NULL);
+
     Kill(-(job->pgid), SIGCONT);
     msg("[%d] continue '%s'\n", j, jobcmd(j));
   }
@@ -244,20 +1292,42 @@ bool resumejob(int j, int bg, sigset_t *mask) {
   return true;
 }
 
-/* Kill the job by sending it a SIGTERM. */
-bool killjob(int j) {
+/* Does the signal only stop or continue a process? */
+static bool jobcontrolsig(int sig) {
+  return sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN ||
+         sig == SIGTTOU || sig == SIGCONT;
+}
+
+/* Kill the job by sending it a signal (e.g. SIGTERM). Queued job is just
+ * cancelled, unless the signal is a job control one. */
+bool killjob(int j, int sig) {
   if (j >= njobmax || jobs[j].state == FINISHED)
     return false;
+  if (jobs[j].state == QUEUED) {
+    if (jobcontrolsig(sig))
+      return false;
+    msg("[%d] cancelled '%s'\n", j, jobs[j].command);
+    unqueuejob(j);
+    resolvejob(j, -1);
+    return true;
+  }
   debug("[%d] killing '%s'\n", j, jobs[j].command);
 
   /* TODO: I love the smell of napalm in the morning. */
 #ifdef STUDENT
 
   job_t *job = &jobs[j];
+  if (!jobcontrolsig(sig))
+    job->killed = true;
+  else if (sig != SIGCONT) {
+    /* Job suspended by hand should stay so, whatever the shell thinks. */
+    unthrottle(j);
+    job->hold = 0;
+  }
 
   /* negative pgid - kill all processes in group */
-  Kill(-(job->pgid), SIGTERM);
-  if (job->state == STOPPED)
+  Kill(-(job->pgid), sig);
+  if ((job->state == STOPPED || job->hold) && !jobcontrolsig(sig))
     Kill(-(job->pgid), SIGCONT); /* process has to be concious, to be killed */
 
 #endif /* !STUDENT */
@@ -265,11 +1335,162 @@ bool killjob(int j) {
   return true;
 }
 
-/* Report state of requested background jobs. Clean up finished jobs. */
-void watchjobs(int which) {
+/* Call `func` for each background job in the selection, in one pass over
+ * the job table. Returns the number of jobs for which `func` succeeded. */
+int foreachjob(jobsel_t *sel, bool (*func)(int j, void *arg), void *arg) {
+  int n = 0;
+
+  for (int j = max(sel->first, BG); j < njobmax && j <= sel->last; j++) {
+    job_t *job = &jobs[j];
+    int state = job->state;
+
+    if (job->pgid == 0 && state != QUEUED)
+      continue;
+    if (state == FINISHED || (sel->state != ALL && sel->state != state))
+      continue;
+    if (sel->pattern && !strstr(job->command, sel->pattern))
+      continue;
+    if (func(j, arg))
+      n++;
+  }
+  return n;
+}
+
+/* Background job that may still finish, i.e. it's running or queued. */
+static bool pendingjob(int j) {
+  return j >= BG && j < njobmax &&
+         ((jobs[j].pgid != 0 && jobs[j].state == RUNNING) ||
+          jobs[j].state == QUEUED);
+}
+
+/* Wait for given background jobs to finish, or for every pending one if
+ * `njob` is zero. If `any` is set, then return as soon as one of them has
+ * finished. Waited jobs are deleted without being reported. A queued job
+ * that could not be started counts as failed.
+ * Returns exit code of the last job on the list (or the first one that has
+ * finished), -1 if a job does not exist, 128 + SIGINT if interrupted, or
+ * 128 + SIGTSTP if a job is suspended, as it would never finish. */
+int waitjobs(int *job, int njob, bool any, sigset_t *mask) {
+  int pending[njobmax];
+  int code = 0;
+
+  if (njob == 0) {
+    for (int j = BG; j < njobmax; j++)
+      if (pendingjob(j))
+        pending[njob++] = j;
+    job = pending;
+    if (any && njob == 0)
+      return -1;
+  }
+
+  for (int i = 0; i < njob; i++)
+    if (job[i] < BG || job[i] >= njobmax ||
+        (jobs[job[i]].pgid == 0 && jobs[job[i]].state != QUEUED))
+      return -1;
+
+  interrupted = 0;
+
+  for (int left = njob; left > 0;) {
+    for (int i = 0; i < njob; i++) {
+      int status = 1;
+      if (job[i] < 0 || jobs[job[i]].state == QUEUED)
+        continue;
+      /* The slot of a queued job is left empty if it has failed to start. */
+      if (jobs[job[i]].pgid != 0) {
+        int state = jobstate(job[i], &status);
+        if (state == STOPPED) {
+          msg("wait: job %d is suspended\n", job[i]);
+          return 128 + SIGTSTP;
+        }
+        if (state != FINISHED)
+          continue;
+      }
+      if (any || i == njob - 1)
+        code = status;
+      job[i] = -1;
+      left--;
+      if (any)
+        return code;
+    }
+    if (left == 0)
+      break;
+
+    (void)waitevents(-1, mask);
+    runqueue();
+
+    if (interrupted) {
+      interrupted = 0;
+      return 128 + SIGINT;
+    }
+  }
+
+  return code;
+}
+
+/* Report processes of a job together with CPUs they are allowed to run on
+ * and CPU time they have used so far. */
+static void showprocs(job_t *job) {
+  for (int i = 0; i < job->nproc; i++) {
+    proc_t *proc = &job->proc[i];
+    char cpus[256];
+
+    if (proc->state == FINISHED) {
+      msg("    %d exited cpu=%.2fs\n", proc->pid, proc->cpu / 1e6);
+      continue;
+    }
+    if (!getcpus(proc->pid, cpus, sizeof(cpus)))
+      strcpy(cpus, "?");
+    msg("    %d %s cpus=%s cpu=%.2fs%s\n", proc->pid,
+        proc->state == RUNNING ? "running" : "suspended", cpus,
+        proccpu(proc->pid) / 1e6, proc->adopted ? " adopted" : "");
+  }
+}
+
+/* Aggregate state of job array processes, e.g.
+ * "[1-100]: 70 running, 0 suspended, 25 exited, 5 failed".
+ * Returns false if the job is not an array. */
+static bool arraystate(job_t *job, char *buf, size_t size) {
+  int count[3] = {0, 0, 0}; /* indexed by FINISHED, RUNNING, STOPPED */
+  int failed = 0;
+
+  if (job->array < 0)
+    return false;
+
+  for (int i = 0; i < job->nproc; i++) {
+    count[job->proc[i].state]++;
+    if (job->proc[i].state == FINISHED && job->proc[i].exitcode != 0)
+      failed++;
+  }
+
+  snprintf(buf, size, "[%d-%d]: %d running, %d suspended, %d exited, %d failed",
+           job->array, job->array + job->nproc - 1, count[RUNNING],
+           count[STOPPED], count[FINISHED] - failed, failed);
+  return true;
+}
+
+/* Report state of requested background jobs. Clean up finished jobs.
+ * In verbose mode processes of running and suspended jobs are listed too. */
+void watchjobs(int which, bool verbose) {
+  /* Orphans get reparented before their parent is reported to have exited.
+   * They keep its job alive, so take them over before it's reported. */
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  adoptorphans();
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
   for (int j = BG; j < njobmax; j++) {
-    if (jobs[j].pgid == 0)
+    if (jobs[j].pgid == 0) {
+      if (jobs[j].state == QUEUED && which == ALL) {
+        job_t *job = &jobs[j];
+        msg("[%d] queued '%s'", j, job->command);
+        if (job->nafter > 0)
+          msg(" %s", job->onsuccess ? "onsuccess" : "after");
+        for (int k = 0; k < job->nafter; k++)
+          msg(" %%%d", job->after[k]);
+        msg("\n");
+      }
       continue;
+    }
 
       /* TODO: Report job number, state, command and exit code or signal. */
 #ifdef STUDENT
@@ -280,11 +1501,26 @@ void watchjobs(int which) {
       &cmd,
       jobcmd(
         j)); /* jobstate deletes job, so we need to remember it somewhere */
+    char array[128];
+    bool isarray = arraystate(&jobs[j], array, sizeof(array));
+    int requests = jobs[j].requests;
     int status =
       jobstate(j, &exitcode); /* we clean up finished jobs on the fly */
 
     if ((which == ALL) || (which == status)) {
-      if (status == RUNNING)
+      if (isarray)
+        msg("[%d] %s '%s' %s\n", j,
+            status == RUNNING   ? "running"
+            : status == STOPPED ? "suspended"
+                                : "finished",
+            cmd, array);
+      else if (status == RUNNING && (jobs[j].hold & HOLD_MEMORY))
+        msg("[%d] held '%s'\n", j, cmd);
+      else if (status == RUNNING && jobs[j].coproc)
+        msg("[%d] running '%s' as %%%s\n", j, cmd, jobs[j].coproc);
+      else if (status == RUNNING && jobs[j].cpushare > 0)
+        msg("[%d] running '%s' cpu=%d%%\n", j, cmd, jobs[j].cpushare);
+      else if (status == RUNNING)
         msg("[%d] running '%s'\n", j, cmd);
       else if (status == STOPPED)
         msg("[%d] suspended '%s'\n", j, cmd);
@@ -298,6 +1534,11 @@ void watchjobs(int which) {
         else
           msg("[%d] killed '%s' by signal %d\n", j, cmd, WTERMSIG(exitcode));
       }
+
+      if (status == FINISHED && requests > 1)
+        msg("[%d] served %d identical requests\n", j, requests);
+      if (verbose && status != FINISHED)
+        showprocs(&jobs[j]);
     }
 
     free(cmd);
@@ -307,6 +1548,30 @@ void watchjobs(int which) {
   }
 }
 
+int notify = 1; /* report finished jobs without waiting for next prompt */
+
+/* Called while the shell waits for input, so that the user does not have to
+ * press Enter to learn about finished jobs. Jobs killed by the shell are left
+ * for the next prompt. Returns true if any has been reported, which means
+ * that the prompt needs to be printed again. */
+bool notifyjobs(void) {
+  bool finished = false;
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  for (int j = BG; j < njobmax && notify && !finished; j++)
+    finished = jobs[j].pgid != 0 && jobs[j].state == FINISHED &&
+               !jobs[j].killed;
+  if (finished) {
+    msg("\n");
+    watchjobs(FINISHED, false);
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return finished;
+}
+
 /* Monitor job execution. If it gets stopped move it to background.
  * When a job has finished or has been stopped move shell to foreground. */
 int monitorjob(sigset_t *mask) {
@@ -325,12 +1590,17 @@ int monitorjob(sigset_t *mask) {
    */
   state = jobstate(0, &exitcode);
   while (state != FINISHED && state != STOPPED) {
-    Sigsuspend(mask);
+    (void)waitevents(-1, mask);
+    runqueue();
     state = jobstate(0, &exitcode);
   }
 
+  /* `runqueue` could have moved jobs array. */
+  echocapture(jobs[0].capture, false);
+
   /* move to background */
   if (state == STOPPED) {
+    fgsignal = SIGTSTP;
     int new_j = allocjob();
     movejob(0, new_j);
   }
@@ -373,6 +1643,37 @@ void initjobs(void) {
   Tcgetattr(tty_fd, &shell_tmodes);
 }
 
+/* Progress of shutdown, shared with `escalate`. */
+typedef struct {
+  struct timespec start; /* when jobs have been sent SIGTERM */
+  struct timespec kill;  /* ... and SIGKILL */
+  int nkilled;           /* jobs that have been sent SIGKILL */
+} shutdown_t;
+
+/* Send SIGKILL to jobs that ignored SIGTERM for too long at shutdown. */
+static void escalate(int fd, void *arg) {
+  shutdown_t *s = arg;
+
+  clock_gettime(CLOCK_MONOTONIC, &s->kill);
+  for (int j = FG; j < njobmax; j++) {
+    if (jobs[j].pgid == 0 || jobs[j].state == FINISHED)
+      continue;
+    (void)kill(-jobs[j].pgid, SIGKILL);
+    s->nkilled++;
+  }
+
+  if (fd >= 0)
+    (void)readtimer(fd);
+}
+
+/* Any job that has not finished yet? */
+static bool livejobs(void) {
+  for (int j = FG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && jobs[j].state != FINISHED)
+      return true;
+  return false;
+}
+
 /* Called just before the shell finishes. */
 void shutdownjobs(void) {
   sigset_t mask;
@@ -381,30 +1682,51 @@ void shutdownjobs(void) {
   /* TODO: Kill remaining jobs and wait for them to finish. */
 #ifdef STUDENT
 
-  for (int j = FG; j < njobmax; j++) {
-    job_t *job = &jobs[j];
-
-    if (job->pgid == 0 || job->state == FINISHED)
-      continue;
+  /* Queued jobs will never get a chance to run. */
+  while (nqueued > 0)
+    unqueuejob(queue[0]);
+
+  shutdown_t s = {.nkilled = 0};
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &s.start);
+
+  /* All jobs are signalled at once and die concurrently. */
+  int njobs = 0;
+  for (int j = FG; j < njobmax; j++)
+    if (jobs[j].pgid != 0 && killjob(j, SIGTERM))
+      njobs++;
+
+  int timer = -1;
+  if (njobs > 0 && killtimeout > 0)
+    timer = addtimer(killtimeout, 0, escalate, &s);
+
+  interrupted = 0;
+  while (livejobs()) {
+    (void)waitevents(-1, &mask);
+    /* Impatient user does not want to wait for the deadline. */
+    if (interrupted && s.nkilled == 0)
+      escalate(-1, &s);
+  }
 
-    /* we kind of do monitorjob but simplier */
-    if (j > FG)
-      setfgpgrp(job->pgid);
+  if (timer >= 0)
+    deltimer(timer);
 
-    (void)killjob(j);
+#endif /* !STUDENT */
 
-    /* we don't need to use jobstate-loop here, 'casuse we do watchjobs later*/
-    while (job->state != FINISHED)
-      Sigsuspend(&mask);
+  watchjobs(FINISHED, false);
 
-    if (j > FG)
-      setfgpgrp(getpgrp()); /* give the power to the terminal again */
+#ifdef STUDENT
+  if (njobs > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    msg("shutdown: %d jobs finished in %.0f ms", njobs,
+        elapsed(&s.start, &end) * 1e3);
+    if (s.nkilled > 0)
+      msg(", %d killed after %.0f ms", s.nkilled,
+          elapsed(&s.start, &s.kill) * 1e3);
+    msg("\n");
   }
-
 #endif /* !STUDENT */
 
-  watchjobs(FINISHED);
-
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   Close(tty_fd);
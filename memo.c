@@ -0,0 +1,321 @@
+#include "shell.h"
+
+#include <sys/sendfile.h>
+
+/* Saved output of a command starts with this header. */
+typedef struct {
+  uint32_t magic;
+  int32_t exitcode;
+} memohdr_t;
+
+#define MEMO_MAGIC 0x6f6d656dU
+
+/* Reads done at once, so that a job writing faster than the shell can keep
+ * up does not starve other events. */
+#define MAXREADS 16
+
+/* Output of a command run with 'memo' prefix is read from a pipe by the
+ * event loop, passed to the terminal and written to a cache entry. The entry
+ * gets its final name only if the job has exited on its own. */
+struct memo {
+  int pipe;      /* read end of the pipe, -1 once all writers are gone */
+  int output;    /* write end, until it's handed over to the job */
+  int file;      /* cache entry being written, -1 if it's been given up */
+  char *tmp;     /* temporary name of the entry ... */
+  char *path;    /* ... and the one it's looked up by */
+  bool finished; /* the job has finished and `exitcode` is known */
+  int exitcode;
+};
+
+static memo_t *pending = NULL; /* not yet claimed by a job */
+
+/* Same as `jenkins_hash`, but never reads past the end of `data`, which the
+ * former does for lengths that are not multiple of 4. */
+uint32_t hashbytes(const void *data, size_t len, uint32_t hash) {
+  uint32_t buf[64], *words = buf;
+
+  if (len >= sizeof(buf))
+    words = Malloc((len / 4 + 1) * sizeof(uint32_t));
+  memcpy(words, data, len);
+  hash = jenkins_hash(words, len, hash);
+  if (words != buf)
+    free(words);
+  return hash;
+}
+
+/* Keys are 64-bit, made of two 32-bit hashes with different seeds, so that
+ * distinct commands are not likely to share an entry. */
+static uint64_t mix(uint64_t key, const void *data, size_t len) {
+  uint32_t lo = hashbytes(data, len, key);
+  uint32_t hi = hashbytes(data, len, (key >> 32) ^ 0x9e3779b9U);
+  return (uint64_t)hi << 32 | lo;
+}
+
+/* Make value of environment variable `name` a part of the key. */
+uint64_t memoenv(uint64_t key, const char *name) {
+  const char *value = getenv(name);
+
+  key = mix(key, name, strlen(name) + 1);
+  if (value)
+    key = mix(key, value, strlen(value) + 1);
+  return key;
+}
+
+/* Make size and modification time of file `path` a part of the key, so that
+ * output is not replayed once the file has changed. */
+uint64_t memofile(uint64_t key, const char *path) {
+  struct stat st;
+  long meta[4] = {-1, -1, -1, -1};
+
+  if (stat(path, &st) == 0) {
+    meta[0] = st.st_size;
+    meta[1] = st.st_mtim.tv_sec;
+    meta[2] = st.st_mtim.tv_nsec;
+    meta[3] = st.st_ino;
+  }
+  key = mix(key, path, strlen(path) + 1);
+  return mix(key, meta, sizeof(meta));
+}
+
+/* Directory of cache entries, created on first use. */
+static const char *memodir(void) {
+  static char dir[PATH_MAX];
+  const char *base = getenv("XDG_CACHE_HOME");
+
+  if (dir[0])
+    return dir;
+
+  if (base && base[0])
+    snprintf(dir, sizeof(dir), "%s", base);
+  else if ((base = getenv("HOME")))
+    snprintf(dir, sizeof(dir), "%s/.cache", base);
+  else
+    return NULL;
+  (void)mkdir(dir, 0700);
+  strncat(dir, "/shell-memo", sizeof(dir) - strlen(dir) - 1);
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    msg("memo: cannot create %s: %s\n", dir, strerror(errno));
+    dir[0] = '\0';
+    return NULL;
+  }
+  return dir;
+}
+
+/* Copy the rest of file `fd` to standard output. Kernel does it without
+ * passing data through the shell, unless the output does not support it. */
+static void copyout(int fd, off_t off, off_t size) {
+  char buf[PIPE_BUF * 16];
+  ssize_t n;
+
+  while (off < size) {
+    if ((n = sendfile(STDOUT_FILENO, fd, &off, size - off)) > 0)
+      continue;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EINVAL && errno != ENOSYS))
+      return;
+    /* Fall back to plain copying. */
+    while ((n = pread(fd, buf, min(sizeof(buf), (size_t)(size - off)), off)) >
+           0) {
+      if (write(STDOUT_FILENO, buf, n) != n)
+        return;
+      off += n;
+    }
+    return;
+  }
+}
+
+/* Write saved output to the terminal. Returns false if there's none. */
+static bool replay(const char *path, int *exitcodep) {
+  memohdr_t hdr;
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != MEMO_MAGIC) {
+    close(fd);
+    return false;
+  }
+  Fstat(fd, &st);
+  copyout(fd, sizeof(hdr), st.st_size);
+  close(fd);
+  *exitcodep = hdr.exitcode;
+  return true;
+}
+
+static void freememo(memo_t *m) {
+  if (m->pipe >= 0) {
+    delevent(m->pipe);
+    Close(m->pipe);
+  }
+  if (m->output >= 0)
+    Close(m->output);
+  if (m->file >= 0) {
+    Close(m->file);
+    (void)unlink(m->tmp);
+  }
+  free(m->tmp);
+  free(m->path);
+  free(m);
+}
+
+/* Give the entry its final name, once both the output and exit code of the
+ * job are known. */
+static void savememo(memo_t *m) {
+  memohdr_t hdr = {.magic = MEMO_MAGIC, .exitcode = m->exitcode};
+
+  if (m->file >= 0 && pwrite(m->file, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+      rename(m->tmp, m->path) == 0) {
+    Close(m->file);
+    m->file = -1;
+  }
+  freememo(m);
+}
+
+/* Pass whatever is waiting in the pipe to the terminal and the entry. */
+static void drain(int fd, void *arg) {
+  memo_t *m = arg;
+  char data[PIPE_BUF * 16];
+  ssize_t n;
+
+  for (int i = 0; i < MAXREADS && (n = read(fd, data, sizeof(data))) > 0;
+       i++) {
+    (void)write(STDOUT_FILENO, data, n);
+    if (m->file >= 0 && write(m->file, data, n) != n) {
+      Close(m->file);
+      (void)unlink(m->tmp);
+      m->file = -1;
+    }
+  }
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    delevent(fd);
+    Close(fd);
+    m->pipe = -1;
+    if (m->finished)
+      savememo(m);
+  }
+}
+
+/* Called by 'memo' prefix for a command line whose leading words have been
+ * consumed by prefix commands. Replays saved output of the command, if there
+ * is one for the key in `jobopts`. Otherwise prepares for the output to be
+ * saved while the command runs, see `memooutput`. Returns true if there's
+ * nothing more to be done with the command line, with saved exit code of the
+ * command (or 1 on error) in `exitcodep`. */
+bool replaymemo(token_t *token, int ntokens, bool bg, int *exitcodep) {
+  char cwd[PATH_MAX], path[PATH_MAX];
+  uint64_t key = jobopts.memo;
+  const char *dir;
+
+  *exitcodep = 1;
+  if (bg) {
+    msg("memo: background jobs are not supported\n");
+    return true;
+  }
+  for (int i = 0; i < ntokens; i++) {
+    if (token[i] == T_OUTPUT) {
+      msg("memo: output of the command must not be redirected\n");
+      return true;
+    }
+    if (string_p(token[i])) {
+      key = mix(key, token[i], strlen(token[i]) + 1);
+    } else {
+      long op = (long)token[i];
+      key = mix(key, &op, sizeof(op));
+    }
+  }
+  if (getcwd(cwd, sizeof(cwd)))
+    key = mix(key, cwd, strlen(cwd) + 1);
+
+  if ((dir = memodir()) == NULL)
+    return false;
+
+  snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)key);
+  if (replay(path, exitcodep))
+    return true;
+
+  /* Entry is written under a name of its own, in case the same command is
+   * run by another shell at the same time. */
+  char tmp[PATH_MAX + 16];
+  memohdr_t hdr = {0};
+  int fds[2];
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int file = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (file < 0 || write(file, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    msg("memo: cannot write %s: %s\n", tmp, strerror(errno));
+    if (file >= 0)
+      close(file);
+    return false;
+  }
+
+  memo_t *m = malloc(sizeof(memo_t));
+  m->path = strdup(path);
+  m->tmp = strdup(tmp);
+  m->file = file;
+  m->finished = false;
+  m->exitcode = -1;
+
+  Pipe(fds);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  m->pipe = fds[0];
+  m->output = fds[1];
+  addevent(m->pipe, drain, m);
+
+  dropmemo();
+  pending = m;
+  return false;
+}
+
+/* Returns write end of the pipe that should become standard output of the
+ * job (or the last stage of a pipeline), or -1 if output is not memoized. */
+int memooutput(void) {
+  int fd = -1;
+
+  if (pending) {
+    fd = pending->output;
+    pending->output = -1;
+  }
+  return fd;
+}
+
+/* Hand over memo prepared by last `replaymemo` to a new job. */
+memo_t *takememo(void) {
+  memo_t *m = pending;
+  pending = NULL;
+  return m;
+}
+
+/* Forget memo that has not been claimed, e.g. by a builtin. */
+void dropmemo(void) {
+  if (pending)
+    freememo(pending);
+  pending = NULL;
+}
+
+/* Called when the job has finished. Output of a job that has been killed by
+ * a signal is not saved, as it's likely incomplete. */
+void finishmemo(memo_t *m, int exitcode, bool signaled) {
+  if (m == NULL)
+    return;
+
+  if (signaled && m->file >= 0) {
+    Close(m->file);
+    (void)unlink(m->tmp);
+    m->file = -1;
+  }
+  m->finished = true;
+  m->exitcode = exitcode;
+
+  /* All processes are gone, so unless they have passed the pipe on to some
+   * other process, the rest of output can be read right away. */
+  if (m->pipe >= 0)
+    drain(m->pipe, m);
+  else
+    savememo(m);
+}
@@ -0,0 +1,140 @@
+#include "shell.h"
+
+/* Read a short text file (e.g. from sysfs or procfs) into `buf`. */
+bool readfile(const char *path, char *buf, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool ok = rereadfile(fd, buf, size);
+  close(fd);
+  return ok;
+}
+
+/* Read the whole file again from the beginning. Keeping descriptors of
+ * /proc files open and rereading them is much cheaper than opening them
+ * each time. */
+bool rereadfile(int fd, char *buf, size_t size) {
+  ssize_t n = pread(fd, buf, size - 1, 0);
+  if (n <= 0)
+    return false;
+  buf[n] = '\0';
+  return true;
+}
+
+/* Open file `name` of process `pid` in /proc. The path is built by hand,
+ * so that it can be called from a signal handler. */
+int openproc(pid_t pid, const char *name) {
+  char path[64] = "/proc/", digits[16];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + pid % 10;
+  } while ((pid /= 10) > 0);
+  char *s = path + strlen(path);
+  while (n > 0)
+    *s++ = digits[--n];
+  *s++ = '/';
+  strcpy(s, name);
+
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Parse /proc/<pid>/stat opened with `openproc`. */
+bool readstat(int fd, procstat_t *st) {
+  static long ticks = 0, pagesize = 0;
+  char buf[1024];
+  long field[25];
+
+  if (ticks == 0) {
+    ticks = sysconf(_SC_CLK_TCK);
+    pagesize = sysconf(_SC_PAGESIZE);
+  }
+
+  if (!rereadfile(fd, buf, sizeof(buf)))
+    return false;
+
+  /* Command name can contain spaces, so fields are counted from its end.
+   * Only numbers up to resident set size (24th field) are of interest. */
+  char *s = strrchr(buf, ')');
+  if (s == NULL || s[1] != ' ' || s[2] == '\0')
+    return false;
+  st->state = s[2];
+  s += 3;
+  for (int i = 4; i <= 24; i++) {
+    char *end;
+    field[i] = strtol(s, &end, 10);
+    if (end == s)
+      return false;
+    s = end;
+  }
+
+  /* utime, stime, cutime and cstime */
+  long cpu = field[14] + field[15] + field[16] + field[17];
+  st->cpu = cpu * (1000000 / ticks);
+  st->rss = field[24] * (pagesize / 1024);
+  st->start = field[22];
+  return true;
+}
+
+/* Returns value of field `name` in text of the form "name: value\n...". */
+static long findfield(const char *buf, const char *name) {
+  size_t len = strlen(name);
+
+  for (const char *s = buf; s; s = strchr(s, '\n')) {
+    if (*s == '\n')
+      s++;
+    if (!strncmp(s, name, len) && s[len] == ':')
+      return strtol(s + len + 1, NULL, 10);
+  }
+  return -1;
+}
+
+/* Parse /proc/<pid>/io opened with `openproc`, i.e. number of bytes the
+ * process has read and written with any kind of file descriptor (including
+ * pipes). Does not use stdio, so it's safe to call from a signal handler. */
+bool readio(int fd, long *rcharp, long *wcharp) {
+  char buf[1024];
+
+  if (!rereadfile(fd, buf, sizeof(buf)))
+    return false;
+  *rcharp = findfield(buf, "rchar");
+  *wcharp = findfield(buf, "wchar");
+  return *rcharp >= 0 && *wcharp >= 0;
+}
+
+/* Returns CPU time (in microseconds) consumed so far by process `pid` and
+ * its children that have been waited for, or -1 if it's not known. */
+long proccpu(pid_t pid) {
+  procstat_t st;
+  int fd = openproc(pid, "stat");
+
+  if (fd < 0)
+    return -1;
+  bool ok = readstat(fd, &st);
+  close(fd);
+  return ok ? st.cpu : -1;
+}
+
+bool procio(pid_t pid, long *rcharp, long *wcharp) {
+  int fd = openproc(pid, "io");
+
+  if (fd < 0)
+    return false;
+  bool ok = readio(fd, rcharp, wcharp);
+  close(fd);
+  return ok;
+}
+
+/* Format number of bytes in human readable form. */
+char *fmtbytes(double n, char *buf, size_t size) {
+  const char *unit = "KMGT";
+
+  if (n < 1024) {
+    snprintf(buf, size, "%.0fB", n);
+    return buf;
+  }
+  for (n /= 1024; n >= 1024 && unit[1]; n /= 1024)
+    unit++;
+  snprintf(buf, size, "%.1f%c", n, *unit);
+  return buf;
+}
@@ -0,0 +1,290 @@
+#include "shell.h"
+
+#include <sys/resource.h>
+#ifdef LINUX
+#include <asm/unistd.h>
+#endif
+
+#define SYSCPU "/sys/devices/system/cpu"
+#define MAXCPU 1024
+
+typedef struct cpu {
+  int id; /* logical CPU number */
+  int l2; /* lowest numbered CPU sharing L2 cache with this one */
+  int l3; /* lowest numbered CPU sharing L3 cache with this one */
+} cpu_t;
+
+int placement = 0; /* pin pipeline stages to CPUs that share caches */
+
+static cpu_t *cpus = NULL; /* online CPUs ordered by shared caches */
+static int ncpus = -1;     /* -1 if topology has not been read yet */
+static int nextcpu = 0;    /* where placement of next pipeline starts */
+
+/* Returns lowest numbered CPU sharing given cache level with `cpu`. */
+static int cacheleader(int cpu, int level) {
+  char path[PATH_MAX], buf[256];
+
+  for (int i = 0;; i++) {
+    snprintf(path, sizeof(path), SYSCPU "/cpu%d/cache/index%d/level", cpu, i);
+    if (!readfile(path, buf, sizeof(buf)))
+      return cpu;
+    if (atoi(buf) != level)
+      continue;
+    snprintf(path, sizeof(path), SYSCPU "/cpu%d/cache/index%d/shared_cpu_list",
+             cpu, i);
+    if (!readfile(path, buf, sizeof(buf)))
+      return cpu;
+    return atoi(buf);
+  }
+}
+
+static int cpucmp(const void *a, const void *b) {
+  const cpu_t *x = a, *y = b;
+  if (x->l3 != y->l3)
+    return x->l3 - y->l3;
+  if (x->l2 != y->l2)
+    return x->l2 - y->l2;
+  return x->id - y->id;
+}
+
+/* Read CPU topology, so that CPUs sharing a cache end up next to each other. */
+static void readtopology(void) {
+  char buf[1024];
+  int online[MAXCPU], n;
+
+  ncpus = 0;
+  if (!readfile(SYSCPU "/online", buf, sizeof(buf)) ||
+      (n = cpulist(buf, online, MAXCPU)) <= 0)
+    return;
+
+  cpus = malloc(sizeof(cpu_t) * n);
+  for (int i = 0; i < n; i++) {
+    int c = online[i];
+    cpus[ncpus++] = (cpu_t){c, cacheleader(c, 2), cacheleader(c, 3)};
+  }
+  qsort(cpus, ncpus, sizeof(cpu_t), cpucmp);
+}
+
+/* Choose CPUs for `nstages` subprocesses of a pipeline. Neighbouring stages
+ * get neighbouring CPUs in cache order, and the whole pipeline is kept within
+ * one L3 domain if it fits. Consecutive pipelines are spread over the machine.
+ * Sets all entries to -1 if placement is disabled or pointless. */
+void placepipeline(int nstages, int *cpu) {
+  for (int i = 0; i < nstages; i++)
+    cpu[i] = -1;
+
+  if (!placement || nstages < 2)
+    return;
+  if (ncpus < 0)
+    readtopology();
+  if (ncpus < 2)
+    return;
+
+  int first = nextcpu % ncpus;
+  int domain = first;
+  while (domain < ncpus && cpus[domain].l3 == cpus[first].l3)
+    domain++;
+  /* Not enough room left in this L3 domain, so start at the next one. */
+  if (domain - first < nstages && domain < ncpus && nstages <= ncpus - domain)
+    first = domain;
+
+  for (int i = 0; i < nstages; i++)
+    cpu[i] = cpus[(first + i) % ncpus].id;
+  nextcpu = (first + nstages) % ncpus;
+}
+
+/* Bind calling process to a single CPU. Used by a child before execve. */
+void pincpu(int cpu) {
+  char list[16];
+
+  if (cpu < 0)
+    return;
+  snprintf(list, sizeof(list), "%d", cpu);
+  if (!setcpus(0, list))
+    msg("sched_setaffinity: %s\n", strerror(errno));
+}
+
+/* Set nice value of process `pid`. Note that unprivileged users can only
+ * lower the priority, unless RLIMIT_NICE says otherwise. */
+bool setnice(pid_t pid, int nice) {
+  return setpriority(PRIO_PROCESS, pid, nice) == 0;
+}
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+static const char *ioclass[] = {"none", "realtime", "best-effort", "idle"};
+
+/* Parse I/O priority given as "class[:level]", where class is one of
+ * `ioclass` names or their number and level is in 0..7 range.
+ * Returns -1 if the specification is not valid. */
+int parseioprio(const char *spec) {
+  size_t len = strcspn(spec, ":");
+  int class = -1, level = 0;
+
+  for (int i = 0; i < 4; i++)
+    if (!strncmp(spec, ioclass[i], len) && len > 0)
+      class = i;
+  if (class < 0 && len == 1 && isdigit(spec[0]))
+    class = spec[0] - '0';
+  if (class < 0 || class > 3)
+    return -1;
+
+  if (spec[len] == ':') {
+    char *end;
+    level = strtol(spec + len + 1, &end, 10);
+    if (*end || level < 0 || level > 7)
+      return -1;
+  }
+
+  return (class << IOPRIO_CLASS_SHIFT) | level;
+}
+
+/* Set I/O priority (as returned by `parseioprio`) of process `pid`. */
+bool setioprio(pid_t pid, int ioprio) {
+  return syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio) == 0;
+}
+
+/* Default scheduling attributes of new jobs, NULL means inherit from shell. */
+char *fgcpus = NULL, *bgcpus = NULL;
+char *fgnice = NULL, *bgnice = NULL;
+char *fgio = NULL, *bgio = NULL;
+
+int autonice = 0; /* demote jobs in background, restore them in foreground */
+
+#define IOPRIO_CLASS_IDLE 3
+
+/* Attributes of background jobs if autonice is on and no defaults given. */
+#define AUTO_NICE 10
+#define AUTO_IOPRIO (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+
+/* Nice value and I/O priority that a job should have in foreground or
+ * background. Returns false for attributes that are to be inherited. */
+static bool jobnice(bool bg, int *nicep) {
+  char *nice = bg ? bgnice : fgnice;
+
+  if (nice)
+    *nicep = atoi(nice);
+  else if (autonice && bg)
+    *nicep = AUTO_NICE;
+  else if (autonice)
+    *nicep = getpriority(PRIO_PROCESS, 0); /* the shell's own */
+  else
+    return false;
+  return true;
+}
+
+static bool jobioprio(bool bg, int *ioprio) {
+  char *io = bg ? bgio : fgio;
+
+  if (io)
+    *ioprio = parseioprio(io);
+  else if (autonice && bg)
+    *ioprio = AUTO_IOPRIO;
+  else if (autonice)
+    *ioprio = syscall(__NR_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  else
+    return false;
+  return true;
+}
+
+/* Apply default scheduling attributes of a foreground or background job
+ * to calling process. Used by a child before execve. */
+void schedself(bool bg) {
+  char *cpus = bg ? bgcpus : fgcpus;
+  int nice, ioprio;
+
+  if (cpus && !setcpus(0, cpus))
+    msg("cpus=%s: %s\n", cpus, strerror(errno));
+  if (jobnice(bg, &nice) && !setnice(0, nice))
+    msg("nice=%d: %s\n", nice, strerror(errno));
+  if (jobioprio(bg, &ioprio) && !setioprio(0, ioprio))
+    msg("ioprio=%d: %s\n", ioprio, strerror(errno));
+}
+
+/* Called for each process of a job that has been moved to background or
+ * foreground while autonice is on. Returns false if it failed, e.g. because
+ * unprivileged users cannot restore priority of a foreground job unless
+ * RLIMIT_NICE allows it. */
+static bool reschedproc(pid_t pid, bool bg) {
+  int nice, ioprio;
+  bool ok = true;
+
+  if (jobnice(bg, &nice) && !setnice(pid, nice))
+    ok = false;
+  if (jobioprio(bg, &ioprio) && !setioprio(pid, ioprio))
+    ok = false;
+  return ok;
+}
+
+void demoteproc(pid_t pid, void *arg) {
+  (void)reschedproc(pid, true);
+}
+
+/* `arg` points to where errno of the first failure is stored. */
+void promoteproc(pid_t pid, void *arg) {
+  int *errp = arg;
+  if (!reschedproc(pid, false) && *errp == 0)
+    *errp = errno;
+}
+
+int maxload = 0;     /* admit background jobs only below this load average */
+int maxpressure = 0; /* ... and below this CPU and memory pressure (in %) */
+
+/* Returns "some avg10" figure of pressure stall information for `res`. */
+static double pressure(const char *res) {
+  char path[PATH_MAX], buf[256];
+  double avg10 = 0.0;
+
+  snprintf(path, sizeof(path), "/proc/pressure/%s", res);
+  if (readfile(path, buf, sizeof(buf)))
+    (void)sscanf(buf, "some avg10=%lf", &avg10);
+  return avg10;
+}
+
+/* Returns true if the machine is too busy to start another background job
+ * according to 'maxload' and 'maxpressure' options. */
+bool overloaded(void) {
+  char buf[256];
+
+  if (maxload > 0 && readfile("/proc/loadavg", buf, sizeof(buf)) &&
+      atof(buf) >= maxload)
+    return true;
+
+  if (maxpressure > 0 &&
+      (pressure("cpu") >= maxpressure || pressure("memory") >= maxpressure))
+    return true;
+
+  return false;
+}
+
+int memguard = 0; /* hold background jobs above this memory pressure (in %) */
+int minfree = 0;  /* ... or below this much available memory (in MiB) */
+
+/* Returns MemAvailable figure from /proc/meminfo in MiB, or -1. */
+static long memavailable(void) {
+  char buf[4096];
+
+  if (!readfile("/proc/meminfo", buf, sizeof(buf)))
+    return -1;
+  char *s = strstr(buf, "MemAvailable:");
+  return s ? strtol(s + strlen("MemAvailable:"), NULL, 10) / 1024 : -1;
+}
+
+/* Tells whether background jobs should be held to relieve memory shortage
+ * according to 'memguard' and 'minfree' options. Returns 1 if another job
+ * should be held, -1 if one can be released and 0 otherwise. Jobs are
+ * released only after pressure drops below half of the threshold and
+ * available memory grows over twice the floor, so they do not flap. */
+int memverdict(void) {
+  double psi = memguard > 0 ? pressure("memory") : 0;
+  long avail = minfree > 0 ? memavailable() : -1;
+
+  if ((memguard > 0 && psi >= memguard) ||
+      (minfree > 0 && avail >= 0 && avail < minfree))
+    return 1;
+  if ((memguard > 0 && psi >= memguard / 2.0) ||
+      (minfree > 0 && avail >= 0 && avail < 2L * minfree))
+    return 0;
+  return -1;
+}
@@ -10,7 +10,7 @@ import subprocess
 import random
 import time
 import sys
-from tempfile import NamedTemporaryFile
+from tempfile import NamedTemporaryFile, TemporaryDirectory
 
 
 LOGFILE = 'sh-tests.{}.log'.format(os.getpid())
@@ -304,6 +304,455 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
         self.expect_exact("[1] killed 'sleep 1000' by signal 15")
         self.expect_exact("[2] killed 'sleep 2000' by signal 15")
 
+    def test_set_range(self):
+        self.sendline('set maxjobs=-1')
+        self.expect_exact('set: maxjobs must be between 0 and')
+        self.sendline('set killtimeout=-5')
+        self.expect_exact('set: killtimeout must be between 0 and')
+        self.sendline('set memguard=101')
+        self.expect_exact('set: memguard must be between 0 and 100')
+        self.sendline('set maxjobs=4294967297')
+        self.expect_exact('set: maxjobs must be between 0 and')
+        self.sendline('set maxjobs=x')
+        self.expect_exact('set: invalid value of maxjobs: x')
+        self.sendline('set')
+        self.expect_exact('maxjobs=0')
+        self.expect_exact('killtimeout=5000')
+
+    def test_maxjobs_queue(self):
+        self.sendline('set maxjobs=1')
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('sleep 2000 &')
+        self.expect_exact("[2] queued 'sleep 2000 &'")
+        self.sendline('jobs')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.expect_exact("[2] queued 'sleep 2000 &'")
+        # Queued job is started while the shell waits for input.
+        self.sendline('kill %1')
+        self.expect_exact("[2] running 'sleep 2000'")
+        self.sendline('kill %2')
+        self.sendline('jobs')
+        self.expect_exact("[2] killed 'sleep 2000' by signal 15")
+
+    def test_array_failure(self):
+        with NamedTemporaryFile(mode='w') as script:
+            script.write('sleep 0.5\n'
+                         'test $JOB_INDEX = 2 && kill -9 $$\n'
+                         'exit 0\n')
+            script.flush()
+            self.sendline(f'sh {script.name} &[1-3]')
+            self.expect_exact(f"[1] running 'sh {script.name}' [1-3]")
+            self.sendline('echo ok &onsuccess %1')
+            self.expect_exact("[2] queued 'echo ok &'")
+            # Dependent job is cancelled as soon as the array has finished.
+            self.expect_exact("[2] cancelled 'echo ok &'", timeout=5)
+            self.expect_exact('2 exited, 1 failed')
+
+    def test_profile(self):
+        # Data counts are read after the processes have exited.
+        self.sendline('profile dd if=/dev/zero bs=1M count=5 | cat >/dev/null')
+        stage = r'{} +\d+ +\S+ +\d+% +\d+% +5\.0M +5\.0M .* {}'
+        self.expect(stage.format(1, 'dd if=/dev/zero'))
+        self.expect(stage.format(2, 'cat'))
+        self.expect_exact('bottleneck: stage')
+
+    def test_xargs_redirect(self):
+        with NamedTemporaryFile(mode='w') as inf:
+            inf.write('a\nb c\nd\n')
+            inf.flush()
+            lines = self.execute('xargs echo < ' + inf.name)
+            self.assertEqual(lines[-1], 'a b c d')
+            lines = self.execute('parallel echo x < ' + inf.name)
+            self.assertEqual(sorted(lines[:-1]), ['x a', 'x b c', 'x d'])
+        # Redirections of a builtin are undone and closed by the shell.
+        lines = self.execute('ls -l /proc/%d/fd' % self.pid)
+        self.assertEqual(len(lines), 5)
+        for i in range(4):
+            self.assertIn('%d -> /dev/pts/' % i, lines[i + 1])
+
+    def test_wait(self):
+        self.sendline('sleep 1 &')
+        self.expect_exact("[1] running 'sleep 1'")
+        self.execute('wait %1')
+        # Waited job is gone without being reported.
+        lines = self.execute('jobs')
+        self.assertEqual([line for line in lines if line], [])
+
+    def test_wait_not_started(self):
+        self.sendline('set maxjobs=1')
+        self.sendline('sleep 1 &')
+        self.expect_exact("[1] running 'sleep 1'")
+        self.sendline('timeout bogus cat &')
+        self.expect_exact("[2] queued 'timeout bogus cat &'")
+        self.sendline('wait %2')
+        self.expect_exact('timeout: usage:')
+        self.sendline('jobs')
+        self.expect_exact("[1] exited 'sleep 1', status=0")
+
+    def test_wait_suspended(self):
+        self.sendline('cat &')
+        self.expect_exact("[1] running 'cat'")
+        self.sendline('wait %1')
+        self.expect_exact('wait: job 1 is suspended')
+        self.sendline('kill %1')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'cat' by signal 15")
+
+    def test_timeout(self):
+        self.sendline('timeout 0.5 sleep 100')
+        self.expect_exact("[0] timed out 'sleep 100'", timeout=5)
+        self.expect('#')
+        # SIGCONT is not going to stop it, SIGKILL after grace period will.
+        self.sendline('timeout -s CONT -k 200ms 0.2 sleep 100')
+        self.expect_exact("[0] timed out 'sleep 100'", timeout=5)
+        self.expect('#', timeout=5)
+
+    def test_timeout_bad_duration(self):
+        for duration in ['0.1ms', '1e30', 'nan', '5x']:
+            self.sendline(f'timeout {duration} sleep 100')
+            self.expect_exact('timeout: usage:', timeout=5)
+
+    def test_kill_range(self):
+        for n in [1000, 2000, 3000]:
+            self.sendline(f'sleep {n} &')
+            self.expect_exact(f"running 'sleep {n}'")
+        self.sendline('kill %1-2')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+        self.expect_exact("[2] killed 'sleep 2000' by signal 15")
+        self.expect_exact("[3] running 'sleep 3000'")
+        self.sendline('kill %all')
+        self.sendline('jobs')
+        self.expect_exact("[3] killed 'sleep 3000' by signal 15")
+
+    def test_resume_selection(self):
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('sleep 2000 &')
+        self.expect_exact("[2] running 'sleep 2000'")
+        self.sendline('kill -STOP %?2000')
+        self.sendline('jobs')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.expect_exact("[2] suspended 'sleep 2000'")
+        self.sendline('bg %stopped')
+        self.expect_exact("[2] continue 'sleep 2000'")
+        self.sendline('kill %all')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+        self.expect_exact("[2] killed 'sleep 2000' by signal 15")
+
+    def test_fg_skips_queued(self):
+        self.sendline('set maxjobs=1')
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('sleep 2000 &')
+        self.expect_exact("[2] queued 'sleep 2000 &'")
+        self.sendline('fg')
+        self.expect_exact("[1] continue 'sleep 1000'")
+        self.sendintr()
+        self.expect_exact("[2] running 'sleep 2000'")
+        self.sendline('kill %2')
+        self.sendline('jobs')
+        self.expect_exact("[2] killed 'sleep 2000' by signal 15")
+
+    def test_memo(self):
+        first = self.execute('memo date +%N')
+        self.assertEqual(self.execute('memo date +%N'), first)
+        self.assertNotEqual(self.execute('memo date +%N.'), first)
+        with NamedTemporaryFile(mode='w') as f:
+            cmd = f'memo -i {f.name} date +%N'
+            first = self.execute(cmd)
+            self.assertEqual(self.execute(cmd), first)
+            f.write('changed\n')
+            f.flush()
+            self.assertNotEqual(self.execute(cmd), first)
+
+    def test_memo_rejected(self):
+        self.sendline('memo sleep 1 &')
+        self.expect_exact('memo: background jobs are not supported')
+        self.sendline('memo date > /dev/null')
+        self.expect_exact('memo: output of the command must not be redirected')
+
+    def test_every(self):
+        self.sendline('every 100ms echo tick')
+        self.expect_exact("{1} every 100ms 'echo tick &'")
+        for _ in range(3):
+            self.expect_exact("[1] exited 'echo tick', status=0", timeout=5)
+        self.sendline('every -d 1')
+        self.expect('#')
+        self.assertNotIn('{1}', ' '.join(self.execute('jobs')))
+        self.sendline('every -d 1')
+        self.expect_exact('every: no schedule {1}')
+
+    def test_every_overlap(self):
+        self.sendline('every 100ms sleep 1000')
+        self.expect_exact("[1] running 'sleep 1000'", timeout=5)
+        self.sendline('every -o allow 100ms sleep 2000')
+        self.expect_exact("[3] running 'sleep 2000'", timeout=5)
+        self.sendline('every -d 2')
+        self.sendline('jobs')
+        self.expect("runs 1, skipped [1-9]")
+        self.sendline('every -d 1')
+        self.sendline('kill %all')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+
+    def test_at(self):
+        self.sendline('at +200ms echo once')
+        self.expect_exact("{1} at +200ms 'echo once &'")
+        self.expect_exact("[1] exited 'echo once', status=0", timeout=5)
+        self.assertNotIn('{1}', ' '.join(self.execute('jobs')))
+
+    def test_schedule_usage(self):
+        self.sendline('every 0 echo x')
+        self.expect_exact('every: usage:')
+        self.sendline('every -o never 1s echo x')
+        self.expect_exact('every: usage:')
+        self.sendline('at 25:00 echo x')
+        self.expect_exact('at: usage:')
+        self.sendline('at -d 1')
+        self.expect_exact('at: no schedule {1}')
+
+    def test_bench(self):
+        self.sendline('bench -n 3 -s true')
+        self.expect_exact("bench: 3 runs of 'true'", timeout=5)
+        self.expect(r'wall +min \S+ +median \S+ +p99 \S+ +max \S+ +mean')
+        self.expect(r'launch +min \S+ .*\(fork until execve\)')
+        self.expect(r'spawn +min \S+ .*\(wall, posix_spawn\)')
+        self.expect(r'usage +user \S+ +sys')
+        self.sendline('bench -s true | cat')
+        self.expect_exact('bench: -s works only for a single external command')
+
+    def test_placement(self):
+        self.execute('set placement=1')
+        status = 'grep Cpus_allowed_list /proc/self/status'
+        # A lone command is not pinned, stages of a pipeline are.
+        alone = self.execute(status)[-1]
+        staged = self.execute(status + ' | cat')[-1]
+        self.assertTrue(staged.split()[-1].isdigit())
+        if len(os.sched_getaffinity(0)) > 1:
+            self.assertNotEqual(alone, staged)
+
+    def test_autonice(self):
+        self.execute('set autonice=1')
+        nice = 'awk {print$19} /proc/self/stat'
+        self.assertEqual(self.execute(nice)[-1], '0')
+        with NamedTemporaryFile(mode='r') as outf:
+            self.sendline(f'{nice} > {outf.name} &')
+            self.expect_exact("[1] running 'awk")
+            self.execute('wait %1')
+            self.assertEqual(outf.read().strip(), '10')
+
+    def test_parallel(self):
+        lines = self.execute('parallel -j 2 echo [{}] ::: a b c')
+        self.assertEqual(sorted(lines[:-1]), ['[a]', '[b]', '[c]'])
+        self.assertEqual(lines[-1], 'parallel: 3 jobs, 0 failed')
+        self.sendline('parallel -j 3 test 2 -gt ::: 1 2 3 1')
+        self.expect_exact('parallel: 4 jobs, 2 failed, status=1: 2')
+        self.sendline('parallel -j 0 true ::: 1')
+        self.expect_exact('parallel: usage:')
+
+    def test_xargs_batch(self):
+        with NamedTemporaryFile(mode='w') as inf:
+            inf.write('a b\nc\nd e\n')
+            inf.flush()
+            lines = self.execute(f'xargs -n 2 echo < {inf.name}')
+            self.assertEqual(lines, ['a b', 'c d', 'e'])
+            lines = self.execute(f'xargs -P 3 -n 1 echo < {inf.name}')
+            self.assertEqual(sorted(lines), ['a', 'b', 'c', 'd', 'e'])
+
+    def test_time(self):
+        self.sendline('time sleep 0.2 | cat')
+        self.expect(r'PID +REAL +USER +SYS +MAXRSS +VCSW +IVCSW')
+        # Second stage gets forked a little later than the first one.
+        for _ in range(2):
+            self.expect(r'\d+ +0\.[1-9]\d\ds +\d+\.\d+s +\d+\.\d+s +\d+K')
+        self.expect(r'total +0\.[2-9]\d\ds')
+        # Processes of a job array are only summed up.
+        self.sendline('time true &[1-3]')
+        self.expect(r'\r\n +total ')
+        self.expect_exact('3 exited, 0 failed')
+
+    def test_profile_stages(self):
+        self.sendline('profile echo x | cat | wc -c')
+        self.expect(r'STAGE +PID +CPU +UTIL +PEAK +READ +WRITE +OUTPUT +COMMAND')
+        for i, stage in enumerate(['echo x', 'cat', 'wc -c']):
+            self.expect(fr'{i + 1} +\d+ .*/s  {stage}\r\n')
+        self.expect(r'bottleneck: stage [1-3] \(\d+\)')
+        # A single process has no bottleneck to point at.
+        self.sendline('profile true')
+        self.expect(r'1 +\d+ .*/s  true\r\n')
+        self.expect('#')
+        self.assertNotIn('bottleneck', self.child.before.decode('utf-8'))
+
+    def test_jobs_top(self):
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('jobs -t 100ms')
+        self.expect(r'JOB +PID +S +CPU% +RSS +READ/s +WRITE/s')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.expect(r'\d+ S +\d+\.\d +\S+ +\S+ +\S+')
+        self.expect(r'total +\d+\.\d')
+        # Table is refreshed until Enter is hit.
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('')
+        self.sendline('jobs -t 0')
+        self.expect_exact("jobs: invalid refresh period '0'")
+        self.sendline('kill %1')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+
+    def test_memguard(self):
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        # No machine has that much memory available.
+        self.sendline('set minfree=2147483647')
+        self.expect_exact("[1] held 'sleep 1000' due to memory shortage",
+                          timeout=5)
+        self.sendline('jobs')
+        self.expect_exact("[1] held 'sleep 1000'")
+        self.sendline('set minfree=0')
+        self.expect_exact("[1] released 'sleep 1000'", timeout=5)
+        self.sendline('kill %1')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+
+    def test_throttle(self):
+        self.sendline('yes > /dev/null &')
+        self.expect_exact("[1] running 'yes'")
+        self.sendline('throttle %1 30%')
+        self.sendline('throttle %1')
+        self.expect_exact("[1] cpu=30% 'yes'")
+        time.sleep(2)
+        self.sendline('jobs -l')
+        self.expect_exact("[1] running 'yes' cpu=30%")
+        self.expect(r'\d+ (running|suspended) cpus=\S+ cpu=(\d+\.\d+)s')
+        self.assertLess(float(self.child.match.group(2)), 1.5)
+        self.sendline('throttle %1 off')
+        self.sendline('jobs')
+        self.expect_exact("[1] running 'yes'\r\n")
+        self.sendline('throttle %1 150%')
+        self.expect_exact('throttle: invalid CPU share: 150%')
+        self.sendline('kill %1')
+
+    def test_subreaper(self):
+        with NamedTemporaryFile(mode='w') as script:
+            script.write('sleep 1000 &\n')
+            script.flush()
+            self.execute('set subreaper=1')
+            self.sendline(f'sh {script.name} &')
+            self.expect(r'\[1\] adopted \d+ ')
+            self.sendline('jobs -l')
+            self.expect_exact(f"[1] running 'sh {script.name}'")
+            self.expect(r'\d+ running cpus=\S+ cpu=\d+\.\d+s adopted')
+            self.sendline('kill %1')
+            self.sendline('jobs')
+            # Status of the job is that of its own processes.
+            self.expect_exact(f"[1] exited 'sh {script.name}', status=0")
+
+    def test_after(self):
+        self.sendline('sleep 0.5 &')
+        self.expect_exact("[1] running 'sleep 0.5'")
+        self.sendline('echo first &after %1')
+        self.expect_exact("[2] queued 'echo first &'")
+        self.sendline('false &onsuccess %1')
+        self.expect_exact("[3] queued 'false &'")
+        self.sendline('echo second &onsuccess %3')
+        self.sendline('jobs')
+        self.expect_exact("[2] queued 'echo first &' after %1")
+        self.expect_exact("[3] queued 'false &' onsuccess %1")
+        self.expect_exact("[4] queued 'echo second &' onsuccess %3")
+        self.expect_exact('first', timeout=5)
+        # Job that depends on a failed one is never started.
+        self.expect_exact("[4] cancelled 'echo second &'", timeout=5)
+        self.sendline('echo third &after %7')
+        self.expect_exact('ERROR: No such job: %7')
+        self.sendline('echo third &after 1')
+        self.expect_exact('ERROR: Jobs to wait for must be given as %n!')
+
+    def test_singleflight(self):
+        self.execute('set singleflight=1')
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] joined 'sleep 1000'")
+        # A different command line is a different job.
+        self.sendline('sleep 1001 &')
+        self.expect_exact("[2] running 'sleep 1001'")
+        self.sendline('kill %1 %2')
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 1000' by signal 15")
+        self.expect_exact('[1] served 2 identical requests')
+
+    def test_capture(self):
+        self.execute('set capture=1')
+        self.sendline('seq 1000 &')
+        self.expect_exact("[1] running 'seq 1000'")
+        self.sendline('jobs')
+        self.expect_exact("[1] exited 'seq 1000', status=0")
+        self.sendline('output %1')
+        self.expect_exact('999\r\n1000\r\n')
+        # Only the last KiB of output is kept.
+        numbers = [line for line in self.lines_before() if line.isdigit()]
+        self.assertLess(len(numbers), 1024 // 4 + 2)
+        self.assertGreater(len(numbers), 200)
+        self.sendline('output %2')
+        self.expect_exact('output: no output captured for %2')
+
+    def test_coproc(self):
+        self.sendline('coproc pipe cat')
+        self.expect_exact("[1] running 'cat' as %pipe")
+        self.sendline('coproc pipe cat')
+        self.expect_exact('coproc: coprocess pipe already exists')
+        self.sendline('echo hello >%pipe')
+        self.sendline('head -1 <%pipe')
+        self.expect_exact('hello')
+        self.sendline('echo world >%nope')
+        self.expect_exact('%nope: no such coprocess')
+        # Closing its input lets the coprocess finish.
+        self.sendline('coproc -c pipe')
+        self.sendline('jobs')
+        self.expect_exact("[1] exited 'cat', status=0")
+        self.sendline('coproc -c nope')
+        self.expect_exact('coproc: no coprocess nope')
+
+    def test_watch_files(self):
+        with TemporaryDirectory() as tmpdir:
+            self.sendline(f'watch-files -w 100ms {tmpdir} -- ls {tmpdir}')
+            self.expect_exact(f"[1] exited 'ls {tmpdir}', status=0")
+            with open(os.path.join(tmpdir, 'new'), 'w'):
+                pass
+            self.expect_exact('new', timeout=5)
+            self.expect_exact(f"[1] exited 'ls {tmpdir}', status=0")
+            self.sendline('jobs')
+            self.expect_exact('on change, runs 2, skipped 0')
+            self.sendline(f'watch-files -w 0 {tmpdir} -- ls')
+            self.expect_exact('watch-files: usage:')
+            self.sendline(f'watch-files {tmpdir}/nope -- ls')
+            self.expect_exact(f'watch-files: {tmpdir}/nope: No such file')
+            self.sendline('watch-files -d 1')
+            self.expect('#')
+
+    def test_sched_jobs(self):
+        self.sendline('sleep 1000 &')
+        self.expect_exact("[1] running 'sleep 1000'")
+        self.sendline('renice 7 %1')
+        self.sendline('taskset 0 %1')
+        self.sendline('ionice idle %1')
+        self.sendline('jobs -l')
+        self.expect(r'(\d+) running cpus=0 cpu=')
+        pid = int(self.child.match.group(1))
+        self.assertEqual(os.getpriority(os.PRIO_PROCESS, pid), 7)
+        # Without a job the system utility is run.
+        self.sendline(f'ionice -p {pid}')
+        self.expect_exact('idle')
+        self.sendline('renice x %1')
+        self.expect_exact('renice: nice value expected')
+        self.sendline('taskset 0 %2')
+        self.expect_exact('taskset: job not found: %2')
+        self.sendline('kill %1')
+
 
 class TestShellWithSyscalls(ShellTester, unittest.TestCase):
     def stty(self):
@@ -382,6 +831,9 @@ class TestShellWithSyscalls(ShellTester, unittest.TestCase):
 if __name__ == '__main__':
     os.environ['PATH'] = '/usr/bin:/bin'
     os.environ['LC_ALL'] = 'C'
+    # Output saved by 'memo' must not survive a test run.
+    cache = TemporaryDirectory()
+    os.environ['XDG_CACHE_HOME'] = cache.name
 
     ldd = subprocess.run(['ldd', 'shell'], stdout=subprocess.PIPE)
     for line in ldd.stdout.decode('utf-8').splitlines():
@@ -6,11 +6,15 @@
 #define DEBUG 0
 #include "shell.h"
 
+#include <sys/ioctl.h>
+
 sigset_t sigchld_mask;
 
+volatile sig_atomic_t interrupted = 0;
+
 static void sigint_handler(int sig) {
-  /* No-op handler, we just need break read() call with EINTR. */
-  (void)sig;
+  /* We just need to break read() call or waiting for events with EINTR. */
+  interrupted = 1;
 }
 
 /* Rewrite closed file descriptors to -1,
@@ -22,11 +26,76 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
+/* Make a pipe kept by the shell (see `opencapture`) the standard error of
+ * a process, and its standard output unless that has been redirected. */
+static void redir_capture(int capture, bool output) {
+  if (capture < 0)
+    return;
+  if (!output)
+    Dup2(capture, 1);
+  Dup2(capture, 2);
+  Close(capture);
+}
+
+/* Swap standard input or output of the shell for a redirection of internal
+ * command. Returns the descriptor to restore it from, or -1 if there's none. */
+static int swapfd(int fd, int stdfd) {
+  int saved;
+
+  if (fd < 0)
+    return -1;
+  if ((saved = fcntl(stdfd, F_DUPFD_CLOEXEC, 0)) < 0)
+    unix_error("fcntl error");
+  Dup2(fd, stdfd);
+  return saved;
+}
+
+/* Execute internal command within shell's process, with its standard input
+ * and output redirected for the time being. Returns -1 if it's not one. */
+static int do_builtin(token_t *token, int input, int output) {
+  fflush(stdout);
+  int saved_input = swapfd(input, STDIN_FILENO);
+  int saved_output = swapfd(output, STDOUT_FILENO);
+
+  int exitcode = builtin_command(token);
+
+  fflush(stdout);
+  if (saved_input >= 0) {
+    Dup2(saved_input, STDIN_FILENO);
+    Close(saved_input);
+  }
+  if (saved_output >= 0) {
+    Dup2(saved_output, STDOUT_FILENO);
+    Close(saved_output);
+  }
+  return exitcode;
+}
+
+/* Open file to redirect to, or duplicate the socket of a coprocess if it's
+ * referred to by '%name' (see 'coproc' builtin). Returns -1 if there's no
+ * such coprocess. */
+static int redir_open(const char *path, int flags) {
+  int fd;
+
+  if (path[0] == '%') {
+    if ((fd = coprocfd(path + 1, false)) < 0) {
+      msg("%s: no such coprocess\n", path);
+      return -1;
+    }
+    if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+      unix_error("fcntl error");
+    return fd;
+  }
+  return Open(path, flags, S_IRWXU);
+}
+
 /* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
+ * Put opened file descriptors into inputp & output respectively.
+ * Returns -1 if any of them could not be opened. */
 static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
   token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
   int n = 0;           /* number of tokens after redirections are removed */
+  bool failed = false;
 
   for (int i = 0; i < ntokens; i++) {
     /* TODO: Handle tokens and open files as requested. */
@@ -36,7 +105,9 @@ static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
       mode = T_INPUT;
 
       MaybeClose(inputp);
-      *inputp = Open(token[i + 1], O_RDONLY, 0);
+      *inputp = redir_open(token[i + 1], O_RDONLY);
+      if (*inputp < 0)
+        failed = true;
 
       token[i] = T_NULL;
       token[i + 1] = T_NULL;
@@ -46,7 +117,9 @@ static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
       MaybeClose(outputp);
       /* O_CREAT - create file if it does not exist
        * O_TRUNC - if file exists, truncate it to 0 bytes aka overwrite data */
-      *outputp = Open(token[i + 1], O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+      *outputp = redir_open(token[i + 1], O_WRONLY | O_CREAT | O_TRUNC);
+      if (*outputp < 0)
+        failed = true;
 
       token[i] = T_NULL;
       token[i + 1] = T_NULL;
@@ -60,7 +133,7 @@ static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
   }
 
   token[n] = NULL;
-  return n;
+  return failed ? -1 : n;
 }
 
 /* Execute internal command within shell's process or execute external command
@@ -69,23 +142,45 @@ static int do_job(token_t *token, int ntokens, bool bg) {
   int input = -1, output = -1;
   int exitcode = 0;
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+  if ((ntokens = do_redir(token, ntokens, &input, &output)) < 0) {
+    MaybeClose(&input);
+    MaybeClose(&output);
+    return 1;
+  }
 
   if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
+    /* Builtins run by the shell itself are not jobs, so prefix commands do
+     * not apply to them nor to jobs they start. */
+    jobopts_t opts = jobopts;
+    jobopts = (jobopts_t){0};
+    if ((exitcode = do_builtin(token, input, output)) >= 0) {
+      MaybeClose(&input);
+      MaybeClose(&output);
       return exitcode;
+    }
+    jobopts = opts;
   }
 
+  /* Look the command up here, so that the child finds it in the cache. */
+  if (ntokens > 0)
+    (void)findcommand(token[0]);
+
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
+  int capture = bg ? opencapture() : -1;
+  if (output < 0)
+    output = memooutput();
+
   /* TODO: Start a subprocess, create a job and monitor it. */
 #ifdef STUDENT
 
   pid_t pid;
 
+  markfork();
   if ((pid = Fork()) == 0) /* child process */
   {
+    stampfork();
     /* signal handling */
     Sigprocmask(SIG_SETMASK, &mask, NULL);
     Signal(SIGTSTP, SIG_DFL);
@@ -99,6 +194,9 @@ static int do_job(token_t *token, int ntokens, bool bg) {
     pid_t pgid = getpid();
     setpgid(pgid, pgid);
 
+    /* default CPUs and priorities of foreground or background jobs */
+    schedself(bg);
+
     if (!bg)
       setfgpgrp(pgid);
 
@@ -111,6 +209,7 @@ static int do_job(token_t *token, int ntokens, bool bg) {
       Dup2(output, 1);
       Close(output);
     }
+    redir_capture(capture, output != -1);
 
     if ((exitcode = builtin_command(token)) >= 0) /* cat & (???)*/
       return exitcode;
@@ -121,6 +220,7 @@ static int do_job(token_t *token, int ntokens, bool bg) {
     setpgid(pid, pid); /* just to be sure */
     MaybeClose(&input);
     MaybeClose(&output);
+    MaybeClose(&capture);
 
     int j = addjob(pid, bg);
     addproc(j, pid, token);
@@ -137,21 +237,111 @@ static int do_job(token_t *token, int ntokens, bool bg) {
   return exitcode;
 }
 
+/* Start job array: a background job consisting of many processes running
+ * the same command, which can tell them apart by JOB_INDEX variable. */
+static int do_array(token_t *token, int ntokens, int first, int last) {
+  int input = -1, output = -1;
+  pid_t pgid = 0;
+  int j = -1;
+
+  if ((ntokens = do_redir(token, ntokens, &input, &output)) < 0) {
+    MaybeClose(&input);
+    MaybeClose(&output);
+    return 1;
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  int capture = opencapture();
+  (void)findcommand(token[0]);
+
+  int i;
+  for (i = first; i <= last; i++) {
+    /* Running out of processes must not take the shell down. */
+    markfork();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      msg("fork: %s\n", strerror(errno));
+      break;
+    }
+
+    if (pid == 0) {
+      char index[16];
+
+      stampfork();
+      Sigprocmask(SIG_SETMASK, &mask, NULL);
+      Signal(SIGTSTP, SIG_DFL);
+      Signal(SIGINT, SIG_DFL);
+      Signal(SIGTTIN, SIG_DFL);
+      Signal(SIGTTOU, SIG_DFL);
+      setpgid(0, pgid);
+      schedself(true);
+
+      snprintf(index, sizeof(index), "%d", i);
+      setenv("JOB_INDEX", index, 1);
+
+      if (input != -1) {
+        Dup2(input, 0);
+        Close(input);
+      }
+      if (output != -1) {
+        Dup2(output, 1);
+        Close(output);
+      }
+      redir_capture(capture, output != -1);
+
+      int exitcode;
+      if ((exitcode = builtin_command(token)) >= 0)
+        exit(exitcode);
+      external_command(token);
+    }
+
+    if (j < 0) {
+      pgid = pid;
+      j = addjob(pgid, BG);
+      arrayjob(j, first);
+      addproc(j, pid, token);
+    } else {
+      addproc(j, pid, NULL);
+    }
+    setpgid(pid, pgid);
+  }
+
+  MaybeClose(&input);
+  MaybeClose(&output);
+  MaybeClose(&capture);
+  if (j >= 0 && i > last)
+    msg("[%d] running '%s' [%d-%d]\n", j, jobcmd(j), first, last);
+  else if (j >= 0)
+    msg("[%d] running '%s' [%d-%d], only %d of %d started\n", j, jobcmd(j),
+        first, i - 1, i - first, last - first + 1);
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return i > last ? 0 : 1;
+}
+
 /* Start internal or external command in a subprocess that belongs to pipeline.
  * All subprocesses in pipeline must belong to the same process group. */
 static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens, bool bg) {
+                      token_t *token, int ntokens, bool bg, int cpu,
+                      int capture) {
   ntokens = do_redir(token, ntokens, &input, &output);
 
   if (ntokens == 0)
     app_error("ERROR: Command line is not well formed!");
+  if (ntokens > 0)
+    (void)findcommand(token[0]);
 
   /* TODO: Start a subprocess and make sure it's moved to a process group. */
+  markfork();
   pid_t pid = Fork();
 #ifdef STUDENT
 
   if (pid == 0) /* child process */
   {
+    stampfork();
     /* signal handling */
     Sigprocmask(SIG_SETMASK, mask, NULL);
     Signal(SIGTSTP, SIG_DFL);
@@ -165,6 +355,10 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
      * process group */
     setpgid(0, pgid);
 
+    /* redirection has failed, it's been reported already */
+    if (ntokens < 0)
+      exit(1);
+
     /* file descriptors */
     if (input != -1) {
       Dup2(input, 0);
@@ -174,6 +368,11 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
       Dup2(output, 1);
       Close(output);
     }
+    redir_capture(capture, output != -1);
+
+    /* default CPUs and priorities, then stay next to neighbouring stages */
+    schedself(bg);
+    pincpu(cpu);
 
     /* option 1: internal command */
     int exitcode = -1;
@@ -194,6 +393,42 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
   return pid;
 }
 
+/* Start external command as a background job without any further parsing
+ * and without reporting it. Used by builtins that run many jobs on their own.
+ * If `io` is not negative it becomes standard input and output of the
+ * command. Returns job number. */
+int spawnjob(char **argv, int io) {
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  (void)findcommand(argv[0]);
+  markfork();
+  pid_t pid = Fork();
+  if (pid == 0) {
+    stampfork();
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTTIN, SIG_DFL);
+    Signal(SIGTTOU, SIG_DFL);
+    setpgid(0, 0);
+    schedself(true);
+    if (io >= 0) {
+      Dup2(io, 0);
+      Dup2(io, 1);
+      Close(io);
+    }
+    external_command(argv);
+  }
+
+  setpgid(pid, pid);
+  int j = addjob(pid, BG);
+  addproc(j, pid, argv);
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return j;
+}
+
 static void mkpipe(int *readp, int *writep) {
   int fds[2];
   Pipe(fds);
@@ -217,18 +452,30 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
+  int capture = bg ? opencapture() : -1;
+  int memo = memooutput();
+
   /* TODO: Start pipeline subprocesses, create a job and monitor it.
    * Remember to close unused pipe ends! */
 #ifdef STUDENT
 
+  /* choose CPUs for all stages up front */
+  int nstages = 1;
+  for (int i = 0; i < ntokens; i++)
+    if (token[i] == T_PIPE)
+      nstages++;
+  int cpu[nstages];
+  placepipeline(nstages, cpu);
+
+  int stage = 0;
   int nstage = 0;
   int start_stage = 0;
   for (int i = 0; i < ntokens; i++) {
     if (token[i] == T_PIPE) /* first and middle processes */
     {
       /* make process */
-      pid =
-        do_stage(pgid, &mask, input, output, token + start_stage, nstage, bg);
+      pid = do_stage(pgid, &mask, input, output, token + start_stage, nstage,
+                     bg, cpu[stage++], capture);
       if (job == -1) /* if first process */
       {
         pgid = pid;
@@ -248,17 +495,19 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
       /* close pipe that we opened in previous move */
       MaybeClose(&output);
       MaybeClose(&next_input);
-      output = -1;
+      output = memo;
 
       /* make process */
       pid = do_stage(pgid, &mask, input, output, token + start_stage,
-                     nstage + 1, bg);
+                     nstage + 1, bg, cpu[stage], capture);
       addproc(job, pid, token + start_stage);
     } else {
       nstage++; /* count tokens in current part of pipeline */
     }
   }
 
+  MaybeClose(&capture);
+
   if (!bg)
     exitcode = monitorjob(&mask);
 
@@ -280,34 +529,256 @@ static bool is_pipeline(token_t *token, int ntokens) {
   return false;
 }
 
-static void eval(char *cmdline) {
+/* Consume prefix commands (e.g. 'timeout') at the front of command line.
+ * Returns false if any of them is malformed. */
+static bool do_prefix(token_t **tokenp, int *ntokensp) {
+  token_t *token = *tokenp;
+  int nwords, n;
+
+  jobopts = (jobopts_t){0};
+
+  do {
+    for (nwords = 0; nwords < *ntokensp && string_p(token[nwords]); nwords++)
+      continue;
+    if ((n = prefix_command(token, nwords)) < 0)
+      return false;
+    token += n;
+    *ntokensp -= n;
+  } while (n > 0);
+
+  *tokenp = token;
+  return true;
+}
+
+/* Job that starts when other jobs have finished is requested with
+ * 'command &after %n...', or 'command &onsuccess %n...' if they all have to
+ * succeed. Strips the clause leaving just '&'. Returns number of jobs to
+ * wait for, 0 if there's no such clause or -1 if it's malformed. */
+static int do_after(token_t *token, int *ntokensp, int *after,
+                    bool *onsuccessp) {
+  int k = *ntokensp - 1, n = 0;
+
+  while (k > 0 && string_p(token[k]))
+    k--;
+  if (k + 1 >= *ntokensp || token[k] != T_BGJOB)
+    return 0;
+  *onsuccessp = !strcmp(token[k + 1], "onsuccess");
+  if (!*onsuccessp && strcmp(token[k + 1], "after"))
+    return 0;
+
+  for (int i = k + 2; i < *ntokensp; i++) {
+    char *end;
+    if (token[i][0] != '%')
+      return -1;
+    after[n++] = strtol(token[i] + 1, &end, 10);
+    if (*end || end == token[i] + 1)
+      return -1;
+  }
+  if (n == 0)
+    return -1;
+
+  *ntokensp = k + 1;
+  token[k + 1] = NULL;
+  return n;
+}
+
+static int countwords(token_t *token, int ntokens) {
+  int n = 0;
+  while (n < ntokens && string_p(token[n]))
+    n++;
+  return n;
+}
+
+/* Handle 'every', 'at' and 'watch-files' commands, which schedule the rest
+ * of command line to be evaluated later. `token` points into `cmdline`, which
+ * is a tokenized copy of `line`, and `bg` tells if the line ended with '&'.
+ * Returns false if it's not such a command. */
+static bool do_schedule(token_t *token, int ntokens, bool bg, char *cmdline,
+                        const char *line) {
+  schedspec_t spec;
+  int nwords = countwords(token, ntokens), n;
+
+  if ((n = schedule_command(token, nwords, &spec)) == 0)
+    return false;
+
+  if (n > 0 && n < nwords) {
+    const char *start = line + (token[0] - cmdline);
+    const char *rest = line + (token[n] - cmdline);
+    int len = rest - start;
+    while (len > 0 && isspace(start[len - 1]))
+      len--;
+    char timing[len + 1];
+    memcpy(timing, start, len);
+    timing[len] = '\0';
+    addschedule(&spec, timing, rest, bg);
+  }
+  return true;
+}
+
+/* Handle 'bench' command, which evaluates the rest of command line many
+ * times. Returns false if it's not 'bench'. */
+static bool do_bench(token_t *token, int ntokens, char *cmdline,
+                     const char *line) {
+  int nwords = countwords(token, ntokens), n, runs, warmup;
+  bool spawn;
+
+  if ((n = bench_command(token, nwords, &runs, &warmup, &spawn)) == 0)
+    return false;
+  if (n > 0)
+    bench(line + (token[n] - cmdline), runs, warmup, spawn);
+  return true;
+}
+
+/* Identity of a background job for 'singleflight', i.e. hash of its command
+ * line, working directory and environment. Zero is never returned. As hashes
+ * can collide, the command line and directory are also returned through
+ * `keyp` (to be freed by the caller) for exact comparison. */
+static uint32_t identity(token_t *token, int ntokens, char **keyp) {
+  char cwd[PATH_MAX], op[16];
+  char *key = NULL;
+  uint32_t hash;
+
+  for (int i = 0; i < ntokens; i++) {
+    if (string_p(token[i])) {
+      strapp(&key, token[i]);
+    } else {
+      /* Words cannot contain angle brackets, so it's not ambiguous. */
+      snprintf(op, sizeof(op), "<%ld>", (long)token[i]);
+      strapp(&key, op);
+    }
+    strapp(&key, " ");
+  }
+  strapp(&key, "\n");
+  if (getcwd(cwd, sizeof(cwd)))
+    strapp(&key, cwd);
+
+  hash = hashbytes(key, strlen(key), 0);
+  for (char **env = environ; *env; env++)
+    hash = hashbytes(*env, strlen(*env) + 1, hash);
+  *keyp = key;
+  return hash ? hash : 1;
+}
+
+/* Returns exit code of a foreground command, or 0 if it's been put into the
+ * background or scheduled, and 1 on errors. */
+int eval(char *cmdline) {
   bool bg = false;
-  int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+  int ntokens, exitcode = 0;
+  char *line = strdup(cmdline); /* tokenizer destroys the command line */
+  token_t *tokens = tokenize(cmdline, &ntokens);
+  token_t *token = tokens;
+  bool array = false;
+  int first, last;
+  int after[ntokens + 1], nafter;
+  bool onsuccess;
+
+  nafter = do_after(token, &ntokens, after, &onsuccess);
+
+  /* Job array is requested with 'command &[first-last]'. */
+  if (ntokens > 1 && token[ntokens - 2] == T_BGJOB &&
+      string_p(token[ntokens - 1]) &&
+      sscanf(token[ntokens - 1], "[%d-%d]", &first, &last) == 2) {
+    token[--ntokens] = NULL;
+    array = true;
+  }
 
   if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
     token[--ntokens] = NULL;
     bg = true;
   }
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
+  uint32_t id = 0;
+  char *key = NULL;
+  if (bg && !array && nafter == 0 && singleflight && ntokens > 0)
+    id = identity(token, ntokens, &key);
+
+  if (nafter < 0) {
+    msg("ERROR: Jobs to wait for must be given as %%n!\n");
+    exitcode = 1;
+  } else if (nafter > 0) {
+    /* Dependent job is queued, with the clause cut off from its line. */
+    strrchr(line, '&')[1] = '\0';
+    (void)afterjob(line, after, nafter, onsuccess);
+  } else if (ntokens > 0 && do_schedule(token, ntokens, bg, cmdline, line)) {
+    /* Command line has been scheduled to run later. */
+  } else if (ntokens > 0 && do_bench(token, ntokens, cmdline, line)) {
+    /* Command line has been run and measured. */
+  } else if (id && joinjob(id, key)) {
+    /* Identical job will report completion for this request too. */
+  } else if (ntokens > 0 && bg && !admitjob()) {
+    /* `runqueue` will give the command line back to us later. */
+    jobopts.identity = id;
+    jobopts.identkey = key;
+    (void)queuejob(line);
+  } else if (ntokens > 0 && !do_prefix(&token, &ntokens)) {
+    /* Error has already been reported. */
+    exitcode = 1;
+  } else if (ntokens > 0 && jobopts.memo &&
+             replaymemo(token, ntokens, bg, &exitcode)) {
+    /* Saved output has been replayed or an error has been reported. */
+  } else if (ntokens > 0) {
+    jobopts.identity = id;
+    jobopts.identkey = key;
+    exitcode = 1;
+    if (array && first > last) {
+      msg("ERROR: Empty job array!\n");
+    } else if (array && is_pipeline(token, ntokens)) {
+      msg("ERROR: Job array of pipelines is not supported!\n");
+    } else if (array) {
+      exitcode = do_array(token, ntokens, first, last);
+    } else if (is_pipeline(token, ntokens)) {
+      exitcode = do_pipeline(token, ntokens, bg);
     } else {
-      do_job(token, ntokens, bg);
+      exitcode = do_job(token, ntokens, bg);
     }
   }
 
-  free(token);
+  dropmemo();
+  jobopts = (jobopts_t){0};
+  free(key);
+  free(tokens);
+  free(line);
+  return exitcode;
 }
 
 #ifndef READLINE
+/* Is there a complete line of input waiting to be read? */
+static bool inputpending(void) {
+  int n;
+  return ioctl(STDIN_FILENO, FIONREAD, &n) == 0 && n > 0;
+}
+
 static char *readline(const char *prompt) {
   static char line[MAXLINE]; /* `readline` is clearly not reentrant! */
 
+  line[0] = '\0';
+
+  /* Serve events and start queued jobs until user types something in.
+   * SIGCHLD is let in only while waiting, so no finished job goes unnoticed. */
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  /* Jobs deleted by last command may have been waited for by queued ones. */
+  runqueue();
   write(STDOUT_FILENO, prompt, strlen(prompt));
 
-  line[0] = '\0';
+  interrupted = 0;
+  for (;;) {
+    /* If a command has been typed ahead, then it comes first. */
+    if (!inputpending() && notifyjobs()) {
+      runqueue();
+      write(STDOUT_FILENO, prompt, strlen(prompt));
+    }
+    if (waitevents(STDIN_FILENO, &mask))
+      break;
+    if (interrupted) {
+      Sigprocmask(SIG_SETMASK, &mask, NULL);
+      msg("\n");
+      return strdup(line);
+    }
+    runqueue();
+  }
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   ssize_t nread = read(STDIN_FILENO, line, MAXLINE);
   if (nread < 0) {
@@ -365,7 +836,7 @@ int main(int argc, char *argv[]) {
       eval(line);
     }
     free(line);
-    watchjobs(FINISHED);
+    watchjobs(FINISHED, false);
   }
 
   msg("\n");
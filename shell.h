@@ -41,22 +41,180 @@ enum {
   FINISHED = 0, /* only jobs that have finished */
   RUNNING = 1,  /* only jobs that are still running */
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
+  QUEUED = 3,   /* background jobs waiting for admission */
 };
 
+int eval(char *cmdline);
+int prefix_command(char **argv, int argc);
+
+/* Options of the next job given by prefix commands, e.g. 'timeout'. */
+typedef struct {
+  long timeout;   /* milliseconds until the job is signalled, 0 if never */
+  int signal;     /* signal to send when time is out */
+  long killafter; /* then send SIGKILL after that many milliseconds */
+  bool time;      /* report resource usage when the job has finished */
+  bool profile;   /* sample processes and report the slowest one */
+  uint32_t identity; /* hash of command and its context for 'singleflight' */
+  char *identkey; /* its command line and directory, copied by the job */
+  uint64_t memo;  /* key of output saved by 'memo', 0 if not used */
+} jobopts_t;
+
+extern jobopts_t jobopts;
+int spawnjob(char **argv, int io);
+
+/* Set by SIGINT handler, so that builtins can notice user interruption. */
+extern volatile sig_atomic_t interrupted;
+
 void initjobs(void);
 void shutdownjobs(void);
 
 int addjob(pid_t pgid, int bg);
+void markfork(void);
 void addproc(int job, pid_t pid, char **argv);
-bool killjob(int job);
-void watchjobs(int state);
+void arrayjob(int job, int first);
+bool killjob(int job, int sig);
+void watchjobs(int state, bool verbose);
+void topjobs(long period);
+bool notifyjobs(void);
+int jobstate(int job, int *statusp);
+int peekjobstate(int job);
 char *jobcmd(int job);
+bool foreachproc(int job, void (*func)(pid_t pid, void *arg), void *arg);
+
+/* Selection of background jobs, e.g. '%1-%5' or '%stopped?make'. */
+typedef struct {
+  int first, last;     /* range of job numbers */
+  int state;           /* ALL, RUNNING or STOPPED */
+  const char *pattern; /* substring of job's command, NULL if any */
+} jobsel_t;
+
+int foreachjob(jobsel_t *sel, bool (*func)(int job, void *arg), void *arg);
 bool resumejob(int job, int bg, sigset_t *mask);
 int monitorjob(sigset_t *mask);
+int waitjobs(int *job, int njob, bool any, sigset_t *mask);
+int throttlejob(int job, int share);
+bool joinjob(uint32_t identity, const char *key);
+void setcoproc(int job, const char *name, int fd);
+int coprocfd(const char *name, bool live);
+extern int maxjobs, killtimeout, notify, subreaper, singleflight;
+
+bool admitjob(void);
+int queuejob(const char *cmdline);
+int afterjob(const char *cmdline, int *after, int nafter, bool onsuccess);
+void runqueue(void);
 
 void setfgpgrp(pid_t pgid);
 
+/* CPU placement and priority of job's processes. */
+extern int placement, autonice, maxload, maxpressure, memguard, minfree;
+extern char *fgcpus, *bgcpus, *fgnice, *bgnice, *fgio, *bgio;
+
+void placepipeline(int nstages, int *cpu);
+void pincpu(int cpu);
+void schedself(bool bg);
+int cpulist(const char *list, int *cpu, int max);
+bool getcpus(pid_t pid, char *buf, size_t size);
+bool setcpus(pid_t pid, const char *list);
+bool setnice(pid_t pid, int nice);
+int parseioprio(const char *spec);
+bool setioprio(pid_t pid, int ioprio);
+void demoteproc(pid_t pid, void *arg);
+void promoteproc(pid_t pid, void *arg);
+bool overloaded(void);
+int memverdict(void);
+
+/* Reading information about processes. */
+typedef struct {
+  char state; /* as in ps(1), e.g. R for running or T for stopped */
+  long cpu;   /* user and system time of process and its children in us */
+  long rss;   /* resident set size in KiB */
+  long start; /* when the process started, in clock ticks after boot */
+} procstat_t;
+
+bool readfile(const char *path, char *buf, size_t size);
+bool rereadfile(int fd, char *buf, size_t size);
+int openproc(pid_t pid, const char *name);
+bool readstat(int fd, procstat_t *st);
+bool readio(int fd, long *rcharp, long *wcharp);
+long proccpu(pid_t pid);
+bool procio(pid_t pid, long *rcharp, long *wcharp);
+char *fmtbytes(double n, char *buf, size_t size);
+
+/* Output of background jobs kept by the shell. */
+typedef struct capture capture_t;
+
+extern int capture;
+
+int opencapture(void);
+capture_t *takecapture(void);
+void freecapture(capture_t *c);
+void showcapture(capture_t *c);
+void echocapture(capture_t *c, bool on);
+void followcapture(capture_t *c);
+capture_t *jobcapture(int job);
+
+/* Output of commands saved and replayed by 'memo' prefix. */
+typedef struct memo memo_t;
+
+uint32_t hashbytes(const void *data, size_t len, uint32_t hash);
+uint64_t memoenv(uint64_t key, const char *name);
+uint64_t memofile(uint64_t key, const char *path);
+bool replaymemo(token_t *token, int ntokens, bool bg, int *exitcodep);
+int memooutput(void);
+memo_t *takememo(void);
+void dropmemo(void);
+void finishmemo(memo_t *m, int exitcode, bool signaled);
+
+/* Commands run periodically, at given time or when files change, by 'every',
+ * 'at' and 'watch-files'. */
+#define OVERLAP_SKIP 0  /* do not start while previous job still runs */
+#define OVERLAP_KILL 1  /* ... or terminate it first */
+#define OVERLAP_ALLOW 2 /* ... or let them run side by side */
+
+typedef struct {
+  long period;          /* milliseconds between runs of 'every', or 0 */
+  struct timespec when; /* wall clock time of 'at' */
+  char **paths;         /* files watched by 'watch-files', or NULL */
+  int npaths;
+  long delay;           /* ms without changes before 'watch-files' runs */
+  int overlap;          /* what if the previous job is still running */
+  bool skiplate;        /* skip runs that cannot start on time */
+} schedspec_t;
+
+extern int scheduling, fgsignal;
+
+void addschedule(schedspec_t *spec, const char *timing, const char *cmdline,
+                 bool bg);
+bool delschedule(int id);
+void runschedules(void);
+void watchschedules(void);
+int scheduledjob(int id);
+int schedule_command(char **argv, int argc, schedspec_t *spec);
+
+/* Repeated measurement of a command line by 'bench'. */
+extern long *launchtime;
+
+void stampfork(void);
+void stampexec(void);
+void bench(const char *cmdline, int n, int warmup, bool spawn);
+int bench_command(char **argv, int argc, int *np, int *warmupp, bool *spawnp);
+
+/* Event loop. */
+typedef void (*evfunc_t)(int fd, void *arg);
+
+void addevent(int fd, evfunc_t func, void *arg);
+void delevent(int fd);
+int addtimer(long ms, long period, evfunc_t func, void *arg);
+int addclocktimer(const struct timespec *when, evfunc_t func, void *arg);
+void settimer(int fd, long ms, long period);
+void deltimer(int fd);
+uint64_t readtimer(int fd);
+bool waitevents(int fd, const sigset_t *mask);
+
+extern int pathcache;
+
 int builtin_command(char **argv);
+const char *findcommand(const char *name);
 noreturn void external_command(char **argv);
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
@@ -0,0 +1,257 @@
+#include "shell.h"
+#include "terminal.h"
+
+#include <stdarg.h>
+#include <sys/ioctl.h>
+
+/* What is known about a process between refreshes of 'jobs -t'. */
+typedef struct sample {
+  pid_t pid;
+  int statfd, iofd; /* kept open, as opening them costs more than reading,
+                     * or -1 if they're opened at each refresh */
+  bool seen;        /* process still exists at this refresh */
+  bool known;       /* has been read before, so rates can be computed */
+  procstat_t st;    /* as read at last refresh */
+  long rchar, wchar;
+  double cpu;          /* CPU utilization (in %) since previous refresh */
+  double rrate, wrate; /* bytes read and written per second */
+} sample_t;
+
+static sample_t *samples = NULL; /* ordered by pid */
+static int nsamples = 0;
+
+/* Files are kept open for that many processes at most, so that job arrays
+ * do not use up all file descriptors of the shell. */
+#define MAXOPEN 128
+
+static int nopen = 0; /* samples with files kept open */
+
+typedef struct {
+  FILE *out;      /* frame is composed in memory and written at once */
+  double period;  /* time since previous refresh in seconds */
+  int rows;       /* lines left on the screen */
+  double cpu;     /* sums over processes of a job */
+  long rss;
+  double rrate, wrate;
+} frame_t;
+
+static int samplecmp(const void *a, const void *b) {
+  const sample_t *x = a, *y = b;
+  return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+/* Find sample of process `pid` or make room for a new one. Insertion shifts
+ * samples with greater pids, which is O(n), but processes of a job are
+ * usually created in order of their pids, so new ones mostly go last. */
+static sample_t *findsample(pid_t pid) {
+  sample_t key = {.pid = pid};
+  sample_t *s = bsearch(&key, samples, nsamples, sizeof(sample_t), samplecmp);
+
+  if (s)
+    return s;
+
+  int i = nsamples;
+  samples = realloc(samples, sizeof(sample_t) * (nsamples + 1));
+  while (i > 0 && samples[i - 1].pid > pid) {
+    samples[i] = samples[i - 1];
+    i--;
+  }
+  nsamples++;
+
+  s = &samples[i];
+  *s = (sample_t){.pid = pid, .statfd = -1, .iofd = -1};
+  if (nopen < MAXOPEN) {
+    s->statfd = openproc(pid, "stat");
+    s->iofd = openproc(pid, "io");
+    if (s->statfd >= 0 || s->iofd >= 0)
+      nopen++;
+  }
+  return s;
+}
+
+static void dropsample(sample_t *s) {
+  if (s->statfd >= 0)
+    close(s->statfd);
+  if (s->iofd >= 0)
+    close(s->iofd);
+  if (s->statfd >= 0 || s->iofd >= 0)
+    nopen--;
+  s->statfd = s->iofd = -1;
+}
+
+/* Read /proc/<pid>/stat through the descriptor kept open, or by opening the
+ * file for a while. A kept descriptor does not read once the process is
+ * gone, even if its pid has been reused, so the file is opened again then. */
+static bool samplestat(sample_t *s, procstat_t *st) {
+  if (s->statfd >= 0 && readstat(s->statfd, st))
+    return true;
+  dropsample(s);
+
+  int fd = openproc(s->pid, "stat");
+  if (fd < 0)
+    return false;
+  bool ok = readstat(fd, st);
+  close(fd);
+  return ok;
+}
+
+/* Forget processes that have not been seen at the last refresh. */
+static void prunesamples(bool all) {
+  int n = 0;
+
+  for (int i = 0; i < nsamples; i++) {
+    if (samples[i].seen && !all) {
+      samples[i].seen = false;
+      samples[n++] = samples[i];
+    } else {
+      dropsample(&samples[i]);
+    }
+  }
+  nsamples = n;
+}
+
+/* Read current state of a process and compute its rates since the previous
+ * refresh. Only deltas are kept, so every refresh reads each file once. */
+static void sampleproc(sample_t *s, double period) {
+  procstat_t st;
+  long rchar, wchar;
+  bool rates = s->known && period > 0;
+
+  s->seen = true;
+
+  if (samplestat(s, &st)) {
+    /* The pid has been reused by another process since last refresh. */
+    if (s->known && st.start != s->st.start) {
+      rates = false;
+      s->cpu = s->rrate = s->wrate = 0;
+    }
+    if (rates)
+      s->cpu = (st.cpu - s->st.cpu) / (period * 1e4);
+    s->st = st;
+    s->known = true;
+  }
+
+  if (s->iofd >= 0 ? readio(s->iofd, &rchar, &wchar)
+                   : procio(s->pid, &rchar, &wchar)) {
+    if (rates) {
+      s->rrate = (rchar - s->rchar) / period;
+      s->wrate = (wchar - s->wchar) / period;
+    }
+    s->rchar = rchar;
+    s->wchar = wchar;
+  }
+}
+
+static void line(frame_t *f, const char *fmt, ...) {
+  va_list ap;
+
+  if (f->rows == 0)
+    return;
+  va_start(ap, fmt);
+  vfprintf(f->out, fmt, ap);
+  va_end(ap);
+  fputs(EL(0) "\n", f->out);
+  f->rows--;
+}
+
+static void showproc(pid_t pid, void *arg) {
+  frame_t *f = arg;
+  sample_t *s = findsample(pid);
+  char rss[16], rrate[16], wrate[16];
+
+  sampleproc(s, f->period);
+  f->cpu += s->cpu;
+  f->rss += s->st.rss;
+  f->rrate += s->rrate;
+  f->wrate += s->wrate;
+
+  line(f, "%5s %7d %c %6.1f %7s %8s %8s", "", pid, s->st.state, s->cpu,
+       fmtbytes(s->st.rss * 1024.0, rss, sizeof(rss)),
+       fmtbytes(s->rrate, rrate, sizeof(rrate)),
+       fmtbytes(s->wrate, wrate, sizeof(wrate)));
+}
+
+static bool showjob(int j, void *arg) {
+  static const char *states[] = {"finished", "running", "suspended", "queued"};
+  frame_t *f = arg;
+  char rss[16], rrate[16], wrate[16];
+
+  /* Summary of the job is known only after its processes have been read,
+   * so it goes below them. */
+  f->cpu = f->rss = f->rrate = f->wrate = 0;
+  line(f, "[%d] %s '%s'", j, states[peekjobstate(j)], jobcmd(j));
+  (void)foreachproc(j, showproc, f);
+  line(f, "%5s %7s %c %6.1f %7s %8s %8s", "", "total", ' ', f->cpu,
+       fmtbytes(f->rss * 1024.0, rss, sizeof(rss)),
+       fmtbytes(f->rrate, rrate, sizeof(rrate)),
+       fmtbytes(f->wrate, wrate, sizeof(wrate)));
+  return true;
+}
+
+/* Redraw the whole table in place. */
+static void redraw(double period) {
+  struct winsize ws = {.ws_row = 24};
+  frame_t f = {.period = period};
+  jobsel_t all = {.first = BG, .last = INT_MAX, .state = ALL};
+  char *buf = NULL;
+  size_t size;
+
+  (void)ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+  f.rows = max(ws.ws_row - 1, 2);
+  f.out = open_memstream(&buf, &size);
+
+  fputs(CUP(1, 1), f.out);
+  line(&f, "%5s %7s %c %6s %7s %8s %8s  (Enter or ^C to quit)", "JOB", "PID",
+       'S', "CPU%", "RSS", "READ/s", "WRITE/s");
+  if (foreachjob(&all, showjob, &f) == 0)
+    line(&f, "no jobs");
+  fputs(ED(0), f.out);
+  fclose(f.out);
+
+  (void)write(STDOUT_FILENO, buf, size);
+  free(buf);
+  prunesamples(false);
+}
+
+static void tick(int fd, void *arg) {
+  (void)readtimer(fd);
+  *(bool *)arg = true;
+}
+
+/* Show jobs and their processes refreshing the table every `period`
+ * milliseconds, until the user presses Enter or ^C. */
+void topjobs(long period) {
+  struct timespec last, now;
+  bool refresh = false;
+  int timer = addtimer(period, period, tick, &refresh);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  (void)write(STDOUT_FILENO, ED(2), strlen(ED(2)));
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  redraw(0);
+
+  interrupted = 0;
+  while (!waitevents(STDIN_FILENO, &mask) && !interrupted) {
+    runqueue();
+    if (!refresh)
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    redraw((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9);
+    last = now;
+    refresh = false;
+  }
+
+  /* Consume the line that has ended the view. */
+  if (!interrupted) {
+    char buf[MAXLINE];
+    (void)read(STDIN_FILENO, buf, sizeof(buf));
+  }
+  interrupted = 0;
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  deltimer(timer);
+  prunesamples(true);
+}